@@ -0,0 +1,400 @@
+/*============================================================================
+Copyright (c) 2024 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+
+#include <signal.h>
+#include <unistd.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/extensions/XInput2.h>
+
+#include "rasputin.h"
+
+extern km_functions_t labwc_ifunctions;
+extern km_functions_t openbox_ifunctions;
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros */
+/*----------------------------------------------------------------------------*/
+
+#define ITERATIONS 20
+
+/* Stand-in compositor - ignores the reload signal and waits to be killed */
+#define FAKE_LABWC "#!/bin/sh\ntrap '' HUP\nwhile true ; do sleep 1 ; done\n"
+
+typedef void (*bench_fn) (void);
+
+/*----------------------------------------------------------------------------*/
+/* Global data */
+/*----------------------------------------------------------------------------*/
+
+/* Setting values used by the backends */
+int dclick, delay, interval;
+float speed;
+gboolean left_handed;
+
+/* Allocation counter, fed by the malloc wrappers below */
+static gint64 allocs;
+
+static char *tmp_dir;
+
+/*----------------------------------------------------------------------------*/
+/* Function prototypes */
+/*----------------------------------------------------------------------------*/
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t n, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+static void write_rc_xml (gsize size);
+static void write_desktop_conf (void);
+static GPid start_fake_labwc (void);
+static GPid start_xvfb (void);
+static void add_libinput_props (void);
+static void remove_tree (const char *path);
+static void run (const char *name, gsize size, bench_fn fn);
+static void next_values (void);
+static void bench_labwc (void);
+static void bench_openbox (void);
+
+/*----------------------------------------------------------------------------*/
+/* Allocation counting */
+/*----------------------------------------------------------------------------*/
+
+void *malloc (size_t size)
+{
+    __atomic_add_fetch (&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc (size);
+}
+
+void *calloc (size_t n, size_t size)
+{
+    __atomic_add_fetch (&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc (n, size);
+}
+
+void *realloc (void *ptr, size_t size)
+{
+    __atomic_add_fetch (&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc (ptr, size);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Synthetic configuration */
+/*----------------------------------------------------------------------------*/
+
+static void write_rc_xml (gsize size)
+{
+    GString *xml = g_string_new (NULL);
+    char *path;
+    int i = 0;
+
+    g_string_append (xml, "<?xml version=\"1.0\"?>\n<openbox_config xmlns=\"http://openbox.org/3.4/rc\">\n"
+        "  <theme>\n    <name>PiXflat</name>\n    <cornerRadius>8</cornerRadius>\n  </theme>\n"
+        "  <keyboard>\n    <repeatRate>25</repeatRate>\n    <repeatDelay>600</repeatDelay>\n");
+
+    // pad the file out to the requested size with keybinds and menus, as found in real user configs
+    while (xml->len < size)
+    {
+        g_string_append_printf (xml, "    <keybind key=\"W-A-%d\">\n      <action name=\"Execute\">\n"
+            "        <command>lxterminal --title=bench-%d -e sh -c 'echo %d'</command>\n      </action>\n    </keybind>\n", i, i, i);
+        if (i % 50 == 0) g_string_append_printf (xml, "    <keybind key=\"C-A-%d\">\n      <action name=\"ShowMenu\">\n"
+            "        <menu>client-menu-%d</menu>\n      </action>\n    </keybind>\n", i, i);
+        i++;
+    }
+
+    g_string_append (xml, "  </keyboard>\n  <mouse>\n    <doubleClickTime>400</doubleClickTime>\n  </mouse>\n"
+        "  <libinput>\n    <device category=\"default\">\n      <pointerSpeed>0.000000</pointerSpeed>\n"
+        "      <leftHanded>no</leftHanded>\n    </device>\n    <device category=\"touchpad\">\n"
+        "      <naturalScroll>yes</naturalScroll>\n      <tap>yes</tap>\n    </device>\n"
+        "    <device category=\"touch\">\n      <calibrationMatrix>1 0 0 0 1 0</calibrationMatrix>\n    </device>\n"
+        "  </libinput>\n</openbox_config>\n");
+
+    path = g_build_filename (tmp_dir, "labwc", "rc.xml", NULL);
+    g_file_set_contents (path, xml->str, xml->len, NULL);
+    g_free (path);
+    g_string_free (xml, TRUE);
+}
+
+static void write_desktop_conf (void)
+{
+    char *path;
+
+    path = g_build_filename (tmp_dir, "lxsession", "bench", "desktop.conf", NULL);
+    g_file_set_contents (path, "[GTK]\nsNet/ThemeName=PiXflat\niNet/DoubleClickTime=250\n\n"
+        "[Mouse]\nAccFactor=20\nAccThreshold=10\nLeftHanded=0\n\n[Keyboard]\nDelay=400\nInterval=250\nBeep=1\n", -1, NULL);
+    g_free (path);
+}
+
+static GPid start_fake_labwc (void)
+{
+    char *path, *argv[2];
+    GPid pid = 0;
+
+    // named labwc, so the reload code recognises it as the compositor
+    path = g_build_filename (tmp_dir, "bin", "labwc", NULL);
+    g_file_set_contents (path, FAKE_LABWC, -1, NULL);
+    g_chmod (path, 0755);
+
+    argv[0] = path;
+    argv[1] = NULL;
+    if (g_spawn_async (NULL, argv, NULL, G_SPAWN_DEFAULT, NULL, NULL, &pid, NULL))
+    {
+        // give the shell time to install its signal trap
+        g_usleep (200000);
+    }
+    g_free (path);
+    return pid;
+}
+
+static GPid start_xvfb (void)
+{
+    char *argv[] = { "Xvfb", "-displayfd", "1", "-nolisten", "tcp", NULL };
+    char buf[16], *disp;
+    GPid pid = 0;
+    int fd, len = 0, n;
+
+    // the server picks a free display and writes its number to stdout once it is ready for clients
+    if (!g_spawn_async_with_pipes (NULL, argv, NULL, G_SPAWN_SEARCH_PATH | G_SPAWN_STDERR_TO_DEV_NULL, NULL, NULL,
+        &pid, NULL, &fd, NULL, NULL)) return 0;
+
+    while (len < sizeof (buf) - 1 && (n = read (fd, buf + len, sizeof (buf) - 1 - len)) > 0)
+    {
+        len += n;
+        if (buf[len - 1] == '\n') break;
+    }
+    close (fd);
+    buf[len] = 0;
+
+    if (!len)
+    {
+        kill (pid, SIGTERM);
+        return 0;
+    }
+
+    disp = g_strdup_printf (":%d", atoi (buf));
+    g_setenv ("DISPLAY", disp, TRUE);
+    g_free (disp);
+    return pid;
+}
+
+static void add_libinput_props (void)
+{
+    XIDeviceInfo *info;
+    Display *disp;
+    Atom speed_atom, left_atom, float_atom;
+    float fval = 0.0;
+    unsigned char bval = 0;
+    int i, ndevs;
+
+    // Xvfb's pointer has no libinput driver - give it the properties the driver would, so the backend writes them
+    disp = XOpenDisplay (NULL);
+    if (!disp) return;
+
+    speed_atom = XInternAtom (disp, "libinput Accel Speed", False);
+    left_atom = XInternAtom (disp, "libinput Left Handed Enabled", False);
+    float_atom = XInternAtom (disp, "FLOAT", False);
+
+    info = XIQueryDevice (disp, XIAllDevices, &ndevs);
+    for (i = 0; i < ndevs; i++)
+    {
+        if (info[i].use != XISlavePointer) continue;
+        XIChangeProperty (disp, info[i].deviceid, speed_atom, float_atom, 32, PropModeReplace, (unsigned char *) &fval, 1);
+        XIChangeProperty (disp, info[i].deviceid, left_atom, XA_INTEGER, 8, PropModeReplace, &bval, 1);
+    }
+    XIFreeDeviceInfo (info);
+
+    XSync (disp, False);
+    XCloseDisplay (disp);
+}
+
+static void remove_tree (const char *path)
+{
+    const char *name;
+    char *child;
+    GDir *dir;
+
+    // never follow a link out of the temporary directory
+    if (g_file_test (path, G_FILE_TEST_IS_DIR) && !g_file_test (path, G_FILE_TEST_IS_SYMLINK))
+    {
+        dir = g_dir_open (path, 0, NULL);
+        if (dir)
+        {
+            while ((name = g_dir_read_name (dir)))
+            {
+                child = g_build_filename (path, name, NULL);
+                remove_tree (child);
+                g_free (child);
+            }
+            g_dir_close (dir);
+        }
+        g_rmdir (path);
+    }
+    else g_remove (path);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Measurement */
+/*----------------------------------------------------------------------------*/
+
+static void run (const char *name, gsize size, bench_fn fn)
+{
+    gint64 start, elapsed, total = 0, min = G_MAXINT64, max = 0, alloc_start, bytes_start;
+    int i;
+
+    alloc_start = __atomic_load_n (&allocs, __ATOMIC_RELAXED);
+    bytes_start = trace_total (TRACE_BYTES_WRITTEN);
+
+    for (i = 0; i < ITERATIONS; i++)
+    {
+        next_values ();
+        start = g_get_monotonic_time ();
+        fn ();
+        elapsed = g_get_monotonic_time () - start;
+
+        total += elapsed;
+        if (elapsed < min) min = elapsed;
+        if (elapsed > max) max = elapsed;
+    }
+
+    printf ("%-24s %10" G_GSIZE_FORMAT " %10.1f %10.1f %10.1f %12.1f %12.1f\n", name, size,
+        total / (double) ITERATIONS, (double) min, (double) max,
+        (__atomic_load_n (&allocs, __ATOMIC_RELAXED) - alloc_start) / (double) ITERATIONS,
+        (trace_total (TRACE_BYTES_WRITTEN) - bytes_start) / (double) ITERATIONS);
+}
+
+static void next_values (void)
+{
+    static int n = 0;
+
+    // alternate the values, so every setter call is a real change
+    n++;
+    dclick = n & 1 ? 300 : 400;
+    delay = n & 1 ? 300 : 600;
+    interval = n & 1 ? 25 : 40;
+    speed = n & 1 ? 0.5 : -0.25;
+    left_handed = n & 1;
+}
+
+static void bench_labwc (void)
+{
+    static const gsize sizes[] = { 1024, 16 * 1024, 256 * 1024, 1024 * 1024, 10 * 1024 * 1024 };
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS (sizes); i++)
+    {
+        write_rc_xml (sizes[i]);
+        run ("labwc load_config", sizes[i], labwc_ifunctions.load_config);
+        run ("labwc set_doubleclick", sizes[i], labwc_ifunctions.set_doubleclick);
+        run ("labwc set_speed", sizes[i], labwc_ifunctions.set_speed);
+        run ("labwc set_keyboard", sizes[i], labwc_ifunctions.set_keyboard);
+        run ("labwc set_lefthanded", sizes[i], labwc_ifunctions.set_lefthanded);
+    }
+    labwc_ifunctions.free_config ();
+}
+
+static void bench_openbox (void)
+{
+    GPid xvfb;
+
+    // the speed and handedness go to X input devices, so the openbox backend needs a server
+    xvfb = start_xvfb ();
+    if (!xvfb)
+    {
+        printf ("openbox: Xvfb not available - skipped\n");
+        return;
+    }
+    add_libinput_props ();
+
+    write_desktop_conf ();
+    run ("openbox load_config", 0, openbox_ifunctions.load_config);
+    run ("openbox set_doubleclick", 0, openbox_ifunctions.set_doubleclick);
+    run ("openbox set_keyboard", 0, openbox_ifunctions.set_keyboard);
+    run ("openbox set_speed", 0, openbox_ifunctions.set_speed);
+    run ("openbox set_lefthanded", 0, openbox_ifunctions.set_lefthanded);
+    openbox_ifunctions.free_config ();
+
+    kill (xvfb, SIGTERM);
+    g_unsetenv ("DISPLAY");
+}
+
+/*----------------------------------------------------------------------------*/
+/* Main function */
+/*----------------------------------------------------------------------------*/
+
+int main (int argc, char *argv[])
+{
+    char *path, *dir;
+    GPid labwc = 0;
+
+    // keep the benchmark away from the real session - these must be set before anything reads them
+    tmp_dir = g_dir_make_tmp ("rasputin-bench-XXXXXX", NULL);
+    if (!tmp_dir) return 1;
+    g_setenv ("XDG_CONFIG_HOME", tmp_dir, TRUE);
+    g_setenv ("DESKTOP_SESSION", "bench", TRUE);
+    g_setenv ("GSETTINGS_BACKEND", "memory", TRUE);
+    g_setenv ("RASPUTIN_RELOAD_MS", "0", TRUE);
+    g_unsetenv ("DISPLAY");
+
+    dir = g_build_filename (tmp_dir, "bin", NULL);
+    path = g_strdup_printf ("%s:%s", dir, g_getenv ("PATH"));
+    g_setenv ("PATH", path, TRUE);
+    g_free (path);
+    g_mkdir_with_parents (dir, 0700);
+    g_free (dir);
+    dir = g_build_filename (tmp_dir, "labwc", NULL);
+    g_mkdir_with_parents (dir, 0700);
+    g_free (dir);
+    dir = g_build_filename (tmp_dir, "lxsession", "bench", NULL);
+    g_mkdir_with_parents (dir, 0700);
+    g_free (dir);
+
+    printf ("%-24s %10s %10s %10s %10s %12s %12s\n", "operation", "size", "mean us", "min us", "max us", "allocs/op", "bytes/op");
+
+    if (argc < 2 || !g_strcmp0 (argv[1], "labwc"))
+    {
+        labwc = start_fake_labwc ();
+        path = g_strdup_printf ("%d", labwc);
+        g_setenv ("LABWC_PID", path, TRUE);
+        g_free (path);
+
+        bench_labwc ();
+
+        if (labwc) kill (labwc, SIGTERM);
+    }
+
+    if (argc < 2 || !g_strcmp0 (argv[1], "openbox")) bench_openbox ();
+
+    remove_tree (tmp_dir);
+    g_free (tmp_dir);
+
+    return 0;
+}
+
+/* End of file */
+/*============================================================================*/
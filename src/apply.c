@@ -0,0 +1,218 @@
+/*============================================================================
+Copyright (c) 2024 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+#include <gio/gio.h>
+
+#include "rasputin.h"
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros */
+/*----------------------------------------------------------------------------*/
+
+/* Result of one backend call, passed back to the main loop */
+typedef struct {
+    guint settings;
+    gint64 usecs;
+} apply_result_t;
+
+/*----------------------------------------------------------------------------*/
+/* Global data */
+/*----------------------------------------------------------------------------*/
+
+static km_functions_t *apply_fn;
+static apply_done_cb apply_cb;
+static gpointer apply_cb_data;
+
+static GThread *worker;
+static GMutex lock;
+static GCond cond;
+
+/* Settings waiting to be applied, with the latest value for each */
+static guint pending_mask;
+static km_values_t pending;
+static gboolean busy, quit;
+
+/*----------------------------------------------------------------------------*/
+/* Function prototypes */
+/*----------------------------------------------------------------------------*/
+
+static void copy_values (km_values_t *dst, const km_values_t *src, guint settings);
+static void call_backend (guint settings, const km_values_t *vals);
+static gboolean report_result (gpointer data);
+static gpointer apply_thread (gpointer data);
+
+/*----------------------------------------------------------------------------*/
+/* Helper functions */
+/*----------------------------------------------------------------------------*/
+
+static void copy_values (km_values_t *dst, const km_values_t *src, guint settings)
+{
+    if (settings & KM_MASK (KM_DCLICK)) dst->dclick = src->dclick;
+    if (settings & KM_MASK (KM_SPEED)) dst->speed = src->speed;
+    if (settings & KM_MASK (KM_KEYBOARD))
+    {
+        dst->delay = src->delay;
+        dst->interval = src->interval;
+    }
+    if (settings & KM_MASK (KM_LEFTHANDED)) dst->left_handed = src->left_handed;
+}
+
+static void call_backend (guint settings, const km_values_t *vals)
+{
+    gint64 span = trace_begin ();
+
+    // the backends read the setting globals, which only this thread writes once running - only the fields
+    // in the batch are valid, so the others keep the values loaded or last applied
+    if (settings & KM_MASK (KM_DCLICK)) dclick = vals->dclick;
+    if (settings & KM_MASK (KM_SPEED)) speed = vals->speed;
+    if (settings & KM_MASK (KM_KEYBOARD))
+    {
+        delay = vals->delay;
+        interval = vals->interval;
+    }
+    if (settings & KM_MASK (KM_LEFTHANDED)) left_handed = vals->left_handed;
+
+    // everything collected since the last call goes to the backend as one batch
+    apply_fn->set_many (settings);
+    trace_end ("set_many", span);
+}
+
+static gboolean report_result (gpointer data)
+{
+    apply_result_t *res = (apply_result_t *) data;
+
+    if (apply_cb) apply_cb (res->settings, res->usecs, apply_cb_data);
+    g_free (res);
+    return FALSE;
+}
+
+static gpointer apply_thread (gpointer data)
+{
+    guint settings;
+    km_values_t vals;
+    apply_result_t *res;
+    gint64 start;
+
+    g_mutex_lock (&lock);
+    while (TRUE)
+    {
+        while (!pending_mask && !quit) g_cond_wait (&cond, &lock);
+        if (!pending_mask) break;
+
+        // take a copy of the newest values, so the main thread can send more while this runs
+        settings = pending_mask;
+        vals = pending;
+        pending_mask = 0;
+        busy = TRUE;
+        g_mutex_unlock (&lock);
+
+        start = g_get_monotonic_time ();
+        call_backend (settings, &vals);
+
+        res = g_new0 (apply_result_t, 1);
+        res->settings = settings;
+        res->usecs = g_get_monotonic_time () - start;
+        g_main_context_invoke (NULL, report_result, res);
+
+        g_mutex_lock (&lock);
+        busy = FALSE;
+        g_cond_broadcast (&cond);
+    }
+    g_mutex_unlock (&lock);
+
+    return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Exported API */
+/*----------------------------------------------------------------------------*/
+
+void apply_init (km_functions_t *fn, apply_done_cb cb, gpointer data)
+{
+    apply_fn = fn;
+    apply_cb = cb;
+    apply_cb_data = data;
+    pending_mask = 0;
+    pending.dclick = dclick;
+    pending.delay = delay;
+    pending.interval = interval;
+    pending.speed = speed;
+    pending.left_handed = left_handed;
+    busy = FALSE;
+    quit = FALSE;
+
+    worker = g_thread_new ("apply", apply_thread, NULL);
+}
+
+void apply_settings (guint settings, const km_values_t *vals)
+{
+    g_mutex_lock (&lock);
+
+    // newer values replace any that have not been applied yet, and join the same batch
+    copy_values (&pending, vals, settings);
+    pending_mask |= settings;
+
+    g_cond_broadcast (&cond);
+    g_mutex_unlock (&lock);
+}
+
+void apply_flush (void)
+{
+    g_mutex_lock (&lock);
+    while (pending_mask || busy) g_cond_wait (&cond, &lock);
+    g_mutex_unlock (&lock);
+}
+
+void apply_cancel (void)
+{
+    g_mutex_lock (&lock);
+
+    // anything not yet started is dropped - a call already in the backend is left to finish
+    pending_mask = 0;
+    g_cond_broadcast (&cond);
+    g_mutex_unlock (&lock);
+}
+
+void apply_shutdown (void)
+{
+    if (!worker) return;
+
+    // let the worker finish anything already queued, then stop it
+    g_mutex_lock (&lock);
+    quit = TRUE;
+    g_cond_broadcast (&cond);
+    g_mutex_unlock (&lock);
+
+    g_thread_join (worker);
+    worker = NULL;
+
+    // results still waiting in the main loop are dropped
+    apply_cb = NULL;
+}
+
+/* End of file */
+/*============================================================================*/
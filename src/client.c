@@ -0,0 +1,231 @@
+/*============================================================================
+Copyright (c) 2024 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+#include <gtk/gtk.h>
+
+#include "rasputin.h"
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros */
+/*----------------------------------------------------------------------------*/
+
+/* Calls are answered once the service has applied them - allow for a slow compositor reload */
+#define CALL_TIMEOUT_MS 5000
+
+/*----------------------------------------------------------------------------*/
+/* Global data */
+/*----------------------------------------------------------------------------*/
+
+static GDBusConnection *bus;
+
+/* Values when the panel was opened, for restore if the service could not take a snapshot */
+static km_values_t orig;
+static gboolean snapped;
+
+/*----------------------------------------------------------------------------*/
+/* Function prototypes */
+/*----------------------------------------------------------------------------*/
+
+static GVariant *call (const char *method, GVariant *params, const GVariantType *reply);
+static void load_config (void);
+static void free_config (void);
+static void set_doubleclick (void);
+static void set_speed (void);
+static void set_keyboard (void);
+static void set_lefthanded (void);
+static void set_many (guint settings);
+static void snapshot (void);
+static void restore (void);
+
+/*----------------------------------------------------------------------------*/
+/* Helper functions */
+/*----------------------------------------------------------------------------*/
+
+static GVariant *call (const char *method, GVariant *params, const GVariantType *reply)
+{
+    gint64 span;
+    GVariant *res;
+
+    span = trace_begin ();
+    res = g_dbus_connection_call_sync (bus, KM_BUS_NAME, KM_BUS_PATH, KM_BUS_IFACE, method, params, reply,
+        G_DBUS_CALL_FLAGS_NONE, CALL_TIMEOUT_MS, NULL, NULL);
+    trace_end ("service call", span);
+    return res;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Exported API */
+/*----------------------------------------------------------------------------*/
+
+gboolean client_connect (gboolean start)
+{
+    GVariant *res;
+
+    if (!bus) bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, NULL);
+    if (!bus) return FALSE;
+
+    // if asked to, the bus starts the service when it is installed but not yet running
+    res = g_dbus_connection_call_sync (bus, KM_BUS_NAME, KM_BUS_PATH, "org.freedesktop.DBus.Peer", "Ping", NULL, NULL,
+        start ? G_DBUS_CALL_FLAGS_NONE : G_DBUS_CALL_FLAGS_NO_AUTO_START, CALL_TIMEOUT_MS, NULL, NULL);
+    if (res)
+    {
+        g_variant_unref (res);
+
+        // the service may have been started from another environment - tell it which backend this session uses
+        res = g_dbus_connection_call_sync (bus, KM_BUS_NAME, KM_BUS_PATH, KM_BUS_IFACE, "SetBackend",
+            g_variant_new ("(s)", KM_SESSION_BACKEND), NULL, G_DBUS_CALL_FLAGS_NONE, CALL_TIMEOUT_MS, NULL, NULL);
+        if (res)
+        {
+            g_variant_unref (res);
+            return TRUE;
+        }
+    }
+
+    g_clear_object (&bus);
+    return FALSE;
+}
+
+static void load_config (void)
+{
+    GVariant *res, *vals;
+    double dval;
+
+    res = call ("GetAll", NULL, G_VARIANT_TYPE ("(a{sv})"));
+    if (!res) return;
+
+    vals = g_variant_get_child_value (res, 0);
+    g_variant_lookup (vals, KM_KEY_DCLICK, "i", &dclick);
+    g_variant_lookup (vals, KM_KEY_DELAY, "i", &delay);
+    g_variant_lookup (vals, KM_KEY_INTERVAL, "i", &interval);
+    g_variant_lookup (vals, KM_KEY_LEFT, "b", &left_handed);
+    if (g_variant_lookup (vals, KM_KEY_SPEED, "d", &dval)) speed = dval;
+    g_variant_unref (vals);
+    g_variant_unref (res);
+}
+
+static void free_config (void)
+{
+    g_clear_object (&bus);
+}
+
+static void set_doubleclick (void)
+{
+    set_many (KM_MASK (KM_DCLICK));
+}
+
+static void set_speed (void)
+{
+    set_many (KM_MASK (KM_SPEED));
+}
+
+static void set_keyboard (void)
+{
+    set_many (KM_MASK (KM_KEYBOARD));
+}
+
+static void set_lefthanded (void)
+{
+    set_many (KM_MASK (KM_LEFTHANDED));
+}
+
+static void set_many (guint settings)
+{
+    GVariantBuilder vals;
+    GVariant *res;
+
+    // everything goes in one SetMany, so the service applies it in one commit
+    g_variant_builder_init (&vals, G_VARIANT_TYPE ("a{sv}"));
+    if (settings & KM_MASK (KM_DCLICK)) g_variant_builder_add (&vals, "{sv}", KM_KEY_DCLICK, g_variant_new_int32 (dclick));
+    if (settings & KM_MASK (KM_SPEED)) g_variant_builder_add (&vals, "{sv}", KM_KEY_SPEED, g_variant_new_double (speed));
+    if (settings & KM_MASK (KM_KEYBOARD))
+    {
+        g_variant_builder_add (&vals, "{sv}", KM_KEY_DELAY, g_variant_new_int32 (delay));
+        g_variant_builder_add (&vals, "{sv}", KM_KEY_INTERVAL, g_variant_new_int32 (interval));
+    }
+    if (settings & KM_MASK (KM_LEFTHANDED)) g_variant_builder_add (&vals, "{sv}", KM_KEY_LEFT, g_variant_new_boolean (left_handed));
+
+    res = call ("SetMany", g_variant_new ("(a{sv})", &vals), NULL);
+    if (res) g_variant_unref (res);
+}
+
+static void snapshot (void)
+{
+    GVariant *res;
+
+    // the service owns the files, so it snapshots them
+    res = call ("Snapshot", NULL, NULL);
+    snapped = res != NULL;
+    if (res) g_variant_unref (res);
+
+    orig.dclick = dclick;
+    orig.delay = delay;
+    orig.interval = interval;
+    orig.speed = speed;
+    orig.left_handed = left_handed;
+}
+
+static void restore (void)
+{
+    GVariant *res;
+
+    if (snapped)
+    {
+        res = call ("Restore", NULL, NULL);
+        if (res)
+        {
+            g_variant_unref (res);
+            return;
+        }
+    }
+
+    // otherwise only the values can be put back
+    dclick = orig.dclick;
+    delay = orig.delay;
+    interval = orig.interval;
+    speed = orig.speed;
+    left_handed = orig.left_handed;
+    set_many (KM_MASK (KM_DCLICK) | KM_MASK (KM_SPEED) | KM_MASK (KM_KEYBOARD) | KM_MASK (KM_LEFTHANDED));
+}
+
+/*----------------------------------------------------------------------------*/
+/* Function table */
+/*----------------------------------------------------------------------------*/
+
+km_functions_t client_ifunctions = {
+    .load_config = load_config,
+    .free_config = free_config,
+    .set_doubleclick = set_doubleclick,
+    .set_speed = set_speed,
+    .set_keyboard = set_keyboard,
+    .set_lefthanded = set_lefthanded,
+    .set_many = set_many,
+    .snapshot = snapshot,
+    .restore = restore,
+};
+
+/* End of file */
+/*============================================================================*/
@@ -0,0 +1,214 @@
+/*============================================================================
+Copyright (c) 2024 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+
+#include "rasputin.h"
+
+/*----------------------------------------------------------------------------*/
+/* Function prototypes */
+/*----------------------------------------------------------------------------*/
+
+static void digest_of (guint8 *digest, const char *data, gsize len);
+static gboolean digest_of_file (guint8 *digest, const char *path);
+static gboolean write_all (int fd, const char *data, gsize len);
+
+/*----------------------------------------------------------------------------*/
+/* Helper functions */
+/*----------------------------------------------------------------------------*/
+
+static void digest_of (guint8 *digest, const char *data, gsize len)
+{
+    GChecksum *sum = g_checksum_new (G_CHECKSUM_SHA256);
+    gsize dlen = COMMIT_DIGEST_LEN;
+
+    g_checksum_update (sum, (const guchar *) data, len);
+    g_checksum_get_digest (sum, digest, &dlen);
+    g_checksum_free (sum);
+}
+
+static gboolean digest_of_file (guint8 *digest, const char *path)
+{
+    GMappedFile *map;
+
+    map = g_mapped_file_new (path, FALSE, NULL);
+    if (!map) return FALSE;
+    digest_of (digest, g_mapped_file_get_contents (map), g_mapped_file_get_length (map));
+    g_mapped_file_unref (map);
+    return TRUE;
+}
+
+static gboolean write_all (int fd, const char *data, gsize len)
+{
+    gssize res;
+
+    while (len)
+    {
+        res = write (fd, data, len);
+        if (res < 0)
+        {
+            if (errno == EINTR) continue;
+            return FALSE;
+        }
+        data += res;
+        len -= res;
+    }
+    return TRUE;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Exported API */
+/*----------------------------------------------------------------------------*/
+
+int commit_file (const char *path, const char *data, gsize len, commit_hash_t *hash)
+{
+    guint8 digest[COMMIT_DIGEST_LEN], old[COMMIT_DIGEST_LEN];
+    gboolean known, ok;
+    GStatBuf st;
+    char *tmp;
+    int fd, mode;
+
+    // a valid hash is the caller's word that it still describes the file - otherwise look at what is there
+    digest_of (digest, data, len);
+    if (hash && hash->valid)
+    {
+        memcpy (old, hash->digest, COMMIT_DIGEST_LEN);
+        known = TRUE;
+    }
+    else known = digest_of_file (old, path);
+
+    if (known && !memcmp (old, digest, COMMIT_DIGEST_LEN))
+    {
+        if (hash)
+        {
+            memcpy (hash->digest, digest, COMMIT_DIGEST_LEN);
+            hash->valid = TRUE;
+        }
+        trace_count (TRACE_WRITES_SKIPPED, 1);
+        return 0;
+    }
+
+    // write a sibling file and rename it over the original, so a crash leaves either the old or the new file
+    mode = g_stat (path, &st) ? 0644 : st.st_mode & 0777;
+    tmp = g_strdup_printf ("%s.XXXXXX", path);
+    fd = g_mkstemp_full (tmp, O_WRONLY, mode);
+    if (fd < 0)
+    {
+        g_free (tmp);
+        if (hash) hash->valid = FALSE;
+        return -1;
+    }
+
+    // the umask applies to the new file - keep the permissions of the one being replaced
+    fchmod (fd, mode);
+
+    // the only fsync of the commit - the rename is not made durable separately
+    ok = write_all (fd, data, len) && !fsync (fd);
+    if (close (fd)) ok = FALSE;
+    if (!ok || g_rename (tmp, path))
+    {
+        g_unlink (tmp);
+        g_free (tmp);
+        if (hash) hash->valid = FALSE;
+        return -1;
+    }
+    g_free (tmp);
+
+    if (hash)
+    {
+        memcpy (hash->digest, digest, COMMIT_DIGEST_LEN);
+        hash->valid = TRUE;
+    }
+    trace_count (TRACE_BYTES_WRITTEN, len);
+    return len;
+}
+
+void snapshot_file (file_snapshot_t *snap, const char *path)
+{
+    free_snapshot (snap);
+    snap->path = g_strdup (path);
+    snap->exists = g_file_get_contents (path, &snap->data, &snap->len, NULL);
+}
+
+int restore_file (const file_snapshot_t *snap)
+{
+    if (!snap->path) return 0;
+
+    // put back the original bytes - unchanged files are not written
+    if (snap->exists) return commit_file (snap->path, snap->data, snap->len, NULL);
+
+    // the file did not exist - remove any that has been created since
+    if (!g_file_test (snap->path, G_FILE_TEST_EXISTS)) return 0;
+    return g_unlink (snap->path) ? -1 : 1;
+}
+
+void free_snapshot (file_snapshot_t *snap)
+{
+    g_free (snap->path);
+    g_free (snap->data);
+    snap->path = NULL;
+    snap->data = NULL;
+    snap->len = 0;
+    snap->exists = FALSE;
+}
+
+gboolean stamp_file (const char *path, file_stamp_t *stamp)
+{
+    GStatBuf st;
+
+    memset (stamp, 0, sizeof (file_stamp_t));
+    if (g_stat (path, &st) || !S_ISREG (st.st_mode)) return FALSE;
+
+    stamp->exists = TRUE;
+    stamp->dev = st.st_dev;
+    stamp->ino = st.st_ino;
+    stamp->size = st.st_size;
+    stamp->mtime = st.st_mtim.tv_sec;
+    stamp->mtime_nsec = st.st_mtim.tv_nsec;
+    return TRUE;
+}
+
+gboolean stamp_current (const char *path, const file_stamp_t *stamp)
+{
+    file_stamp_t now;
+
+    // a file created, deleted, replaced or rewritten since the stamp was taken - our own commits re-stamp
+    stamp_file (path, &now);
+    if (now.exists != stamp->exists) return FALSE;
+    if (!now.exists) return TRUE;
+
+    return now.dev == stamp->dev && now.ino == stamp->ino && now.size == stamp->size
+        && now.mtime == stamp->mtime && now.mtime_nsec == stamp->mtime_nsec;
+}
+
+/* End of file */
+/*============================================================================*/
@@ -26,9 +26,12 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 ============================================================================*/
 
 #include <locale.h>
-#include <gtk/gtk.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+#include <signal.h>
+#include <unistd.h>
 #include <sys/stat.h>
-#include <libxml/xpathInternals.h>
+#include <libxml/xmlreader.h>
 
 #include "rasputin.h"
 
@@ -41,237 +44,875 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define DEFAULT_MOUSE_SPEED 0.0
 #define DEFAULT_MOUSE_DCLICK 400
 
+/* Reloads requested within this many ms of each other are merged - override with RASPUTIN_RELOAD_MS */
+#define DEFAULT_RELOAD_MS 200
+
 #define XC(str) ((xmlChar *) str)
 
+#define OB_NS "http://openbox.org/3.4/rc"
+
+/* Values read from rc.xml by the streaming reader */
+typedef enum {
+    RC_REPEAT_RATE,
+    RC_REPEAT_DELAY,
+    RC_POINTER_SPEED,
+    RC_LEFT_HANDED,
+    RC_N_VALUES
+} rc_value_t;
+
+/* Elements on the path to those values */
+typedef enum {
+    RC_NODE_ROOT,
+    RC_NODE_KEYBOARD,
+    RC_NODE_LIBINPUT,
+    RC_NODE_DEVICE
+} rc_node_t;
+
+/* Written when there is no usable rc.xml to edit */
+#define RC_XML_SKELETON "<?xml version=\"1.0\"?>\n<openbox_config xmlns=\"" OB_NS "\">\n</openbox_config>\n"
+
+/* Markup found by the rc.xml patcher */
+typedef enum {
+    TAG_START,
+    TAG_END,
+    TAG_EMPTY,
+    TAG_OTHER
+} tag_type_t;
+
+typedef struct {
+    tag_type_t type;
+    gsize start, end;
+    gsize name, name_len;
+} xml_tag_t;
+
+/* Byte offsets of an element in the cached rc.xml - inner_end is 0 until find_close has been called */
+typedef struct {
+    gsize start, name_len, head_end, inner_end;
+    gboolean empty;
+} xml_elem_t;
+
+typedef struct {
+    gsize lead, name, name_len, val, val_len, end;
+} xml_attr_t;
+
+/* Bytes of rc.xml, kept between edits - any number of values can be staged before commit -
+   and read_stamp is the state of the file the loaded values were last read from or written to */
+typedef struct {
+    char *file;
+    GString *buf;
+    file_stamp_t stamp, read_stamp;
+    gboolean read_fresh;
+    commit_hash_t hash;
+    gboolean valid;
+    gboolean dirty;
+    GFileMonitor *monitor;
+    GMutex lock;
+} xml_cache_t;
+
 /*----------------------------------------------------------------------------*/
 /* Global data */
 /*----------------------------------------------------------------------------*/
 
 static GSettings *mouse_settings;
+static int dclick_stored;
+static gboolean dclick_stale;
+
+static xml_cache_t xml_cache;
+
+/* State when the panel was opened, for restore */
+static file_snapshot_t rc_snapshot;
+static int dclick_snapshot;
+
+/* Element and attribute names of each rc_value_t */
+static const char *rc_names[RC_N_VALUES] = { "repeatRate", "repeatDelay", "pointerSpeed", "leftHanded" };
+
+/* Compositor reload state */
+static GMutex reload_lock;
+static guint reload_timer;
+static pid_t labwc_pid;
 
 /*----------------------------------------------------------------------------*/
 /* Function prototypes */
 /*----------------------------------------------------------------------------*/
 
+static gboolean rc_element_is (xmlTextReaderPtr reader, const char *name);
+static void rc_store (rc_value_t id, const xmlChar *cont);
+static int rc_read_attrs (xmlTextReaderPtr reader, rc_value_t first, gboolean *found);
+static void read_rc_xml (void);
+static gboolean next_tag (gsize pos, xml_tag_t *tag);
+static gboolean next_attr (gsize pos, xml_attr_t *attr);
+static gboolean name_is (gsize name, gsize len, const char *match);
+static gboolean find_element (gsize pos, const char *name, xml_elem_t *elem);
+static gboolean find_child (const xml_elem_t *parent, const char *name, xml_elem_t *child);
+static gboolean find_close (xml_elem_t *elem);
+static gboolean find_node (const char **path, xml_elem_t *node);
+static void insert_child (xml_elem_t *parent, const char *name, const char *val);
+static void replace_content (xml_elem_t *elem, const char *val);
+static gboolean fix_attributes (const xml_elem_t *elem, gboolean category);
+static gboolean xml_cache_current (void);
+static void xml_cache_load (void);
+static void on_config_changed (GFileMonitor *monitor, GFile *file, GFile *other, GFileMonitorEvent event, gpointer data);
+static void on_dclick_changed (GSettings *settings, const char *key, gpointer data);
+static void begin_xml_edit (void);
 static void set_xml_value (const char *lvl1, const char *lvl2, const char *name, const char *val);
+static void commit_xml_edit (void);
+static gboolean is_labwc (pid_t pid);
+static pid_t find_compositor (void);
+static void send_reload (void);
+static gboolean reload_handler (gpointer data);
+static void request_reload (void);
+static void flush_reload (void);
 static void load_config (void);
+static gboolean config_current (void);
+static void free_config (void);
 static gboolean is_true (const xmlChar *val);
 static void set_doubleclick (void);
 static void set_speed (void);
 static void set_keyboard (void);
 static void set_lefthanded (void);
+static void set_many (guint settings);
+static void snapshot (void);
+static void restore (void);
 
 /*----------------------------------------------------------------------------*/
 /* Helper functions */
 /*----------------------------------------------------------------------------*/
 
-static void set_xml_value (const char *lvl1, const char *lvl2, const char *name, const char *val)
+static gboolean rc_element_is (xmlTextReaderPtr reader, const char *name)
 {
-    char *cptr, *user_config_file = g_build_filename (g_get_user_config_dir (), "labwc/rc.xml", NULL);
+    return !xmlStrcmp (xmlTextReaderConstLocalName (reader), XC (name))
+        && !xmlStrcmp (xmlTextReaderConstNamespaceUri (reader), XC (OB_NS));
+}
 
-    xmlDocPtr xDoc;
-    xmlNodePtr cur_node;
-    xmlXPathObjectPtr xpathObj;
-    xmlXPathContextPtr xpathCtx;
-    xmlAttr *attr;
+static void rc_store (rc_value_t id, const xmlChar *cont)
+{
+    int val;
+    double dval;
+    char *end;
 
-    // read in data from XML file
-    xmlInitParser ();
-    LIBXML_TEST_VERSION
-    if (g_file_test (user_config_file, G_FILE_TEST_IS_REGULAR))
+    if (!cont) return;
+    switch (id)
     {
-        xDoc = xmlReadFile (user_config_file, NULL, XML_PARSE_NOBLANKS);
-        if (!xDoc) xDoc = xmlNewDoc (XC ("1.0"));
+        case RC_REPEAT_RATE :   if (sscanf ((const char *) cont, "%d", &val) == 1 && val > 0) interval = 1000 / val;
+                                break;
+        case RC_REPEAT_DELAY :  if (sscanf ((const char *) cont, "%d", &val) == 1 && val > 0) delay = val;
+                                break;
+        case RC_POINTER_SPEED : dval = g_ascii_strtod ((const char *) cont, &end);
+                                if (end != (const char *) cont) speed = dval;
+                                break;
+        case RC_LEFT_HANDED :   left_handed = is_true (cont);
+                                break;
+        default :               break;
     }
-    else xDoc = xmlNewDoc (XC ("1.0"));
-    xpathCtx = xmlXPathNewContext (xDoc);
-    xmlXPathRegisterNs (xpathCtx, XC ("o"), XC ("http://openbox.org/3.4/rc"));
+}
 
-    // check that the root node exists - create if not
-    xpathObj = xmlXPathEvalExpression (XC ("/o:openbox_config"), xpathCtx);
-    if (xmlXPathNodeSetIsEmpty (xpathObj->nodesetval))
+static int rc_read_attrs (xmlTextReaderPtr reader, rc_value_t first, gboolean *found)
+{
+    xmlChar *cont;
+    int i, n = 0;
+
+    // each node type carries a pair of values - keyboard has the first two, libinput device the second two
+    for (i = first; i < first + 2; i++)
     {
-        cur_node = xmlNewNode (NULL, XC ("openbox_config"));
-        xmlNewNs (cur_node, XC ("http://openbox.org/3.4/rc"), NULL);
-        xmlDocSetRootElement (xDoc, cur_node);
+        cont = xmlTextReaderGetAttribute (reader, XC (rc_names[i]));
+        if (!cont) continue;
+        rc_store (i, cont);
+        xmlFree (cont);
+        found[i] = TRUE;
+        n++;
     }
-    else cur_node = xpathObj->nodesetval->nodeTab[0];
-    xmlXPathFreeObject (xpathObj);
-
-    // check that the top level node (keyboard / mouse / libinput) exists - create if not
-    cptr = g_strdup_printf ("/o:openbox_config/o:%s", lvl1);
-    xpathObj = xmlXPathNodeEval (cur_node, XC (cptr), xpathCtx);
-    g_free (cptr);
+    return n;
+}
 
-    if (xmlXPathNodeSetIsEmpty (xpathObj->nodesetval))
-        cur_node = xmlNewChild (cur_node, NULL, XC (lvl1), NULL);
-    else
-        cur_node = xpathObj->nodesetval->nodeTab[0];
-    xmlXPathFreeObject (xpathObj);
+static void read_rc_xml (void)
+{
+    gboolean found[RC_N_VALUES] = { FALSE };
+    gboolean kbd_seen = FALSE, dev_seen = FALSE, descend;
+    rc_node_t path[3];
+    GMappedFile *map;
+    xmlTextReaderPtr reader;
+    xmlChar *cont;
+    int ret, depth, i, first, nfound = 0;
+    gint64 span;
 
-    // if a second level is required (libinput device), check it exists - create if not
-    if (lvl2)
+    map = g_mapped_file_new (xml_cache.file, FALSE, NULL);
+    if (!map) return;
+    if (!g_mapped_file_get_length (map))
     {
-        cptr = g_strdup_printf ("/o:openbox_config/o:%s/o:%s", lvl1, lvl2);
-        xpathObj = xmlXPathNodeEval (cur_node, XC (cptr), xpathCtx);
-        g_free (cptr);
+        g_mapped_file_unref (map);
+        return;
+    }
 
-        if (xmlXPathNodeSetIsEmpty (xpathObj->nodesetval))
-            cur_node = xmlNewChild (cur_node, NULL, XC (lvl2), NULL);
-        else
-            cur_node = xpathObj->nodesetval->nodeTab[0];
+    span = trace_begin ();
+    reader = xmlReaderForMemory (g_mapped_file_get_contents (map), g_mapped_file_get_length (map), xml_cache.file, NULL,
+        XML_PARSE_NOBLANKS | XML_PARSE_NONET);
 
-        // libinput device nodes require the category property to be set...
-        xmlSetProp (cur_node, XC ("category"), XC ("default"));
-        xmlXPathFreeObject (xpathObj);
+    // one forward pass, stopping as soon as every value has been found - the attribute form on the first
+    // keyboard or device node is seen before any child element, so whichever form is found first wins
+    ret = reader ? xmlTextReaderRead (reader) : -1;
+    while (ret == 1 && nfound < RC_N_VALUES)
+    {
+        descend = xmlTextReaderNodeType (reader) != XML_READER_TYPE_ELEMENT;
+        if (!descend)
+        {
+            depth = xmlTextReaderDepth (reader);
+            if (depth == 0)
+            {
+                if (!rc_element_is (reader, "openbox_config")) break;
+                path[0] = RC_NODE_ROOT;
+                descend = TRUE;
+            }
+            else if (depth == 1 && rc_element_is (reader, "keyboard"))
+            {
+                if (!kbd_seen) nfound += rc_read_attrs (reader, RC_REPEAT_RATE, found);
+                kbd_seen = TRUE;
+                path[1] = RC_NODE_KEYBOARD;
+                descend = TRUE;
+            }
+            else if (depth == 1 && rc_element_is (reader, "libinput"))
+            {
+                path[1] = RC_NODE_LIBINPUT;
+                descend = TRUE;
+            }
+            else if (depth == 2 && path[1] == RC_NODE_LIBINPUT && rc_element_is (reader, "device"))
+            {
+                if (!dev_seen) nfound += rc_read_attrs (reader, RC_POINTER_SPEED, found);
+                dev_seen = TRUE;
+                path[2] = RC_NODE_DEVICE;
+                descend = TRUE;
+            }
+            else if ((depth == 2 && path[1] == RC_NODE_KEYBOARD) || (depth == 3 && path[2] == RC_NODE_DEVICE))
+            {
+                first = depth == 2 ? RC_REPEAT_RATE : RC_POINTER_SPEED;
+                for (i = first; i < first + 2; i++)
+                {
+                    if (found[i] || !rc_element_is (reader, rc_names[i])) continue;
+                    cont = xmlTextReaderReadString (reader);
+                    rc_store (i, cont);
+                    if (cont) xmlFree (cont);
+                    found[i] = TRUE;
+                    nfound++;
+                }
+            }
+        }
+
+        // only the path down to each setting is walked - keybinds, menus and the like are stepped over whole
+        ret = descend ? xmlTextReaderRead (reader) : xmlTextReaderNext (reader);
     }
 
-    // clear any node attributes
-    for (attr = cur_node->properties; attr; attr = attr->next)
+    if (reader) xmlFreeTextReader (reader);
+    trace_end ("scan rc.xml", span);
+    g_mapped_file_unref (map);
+}
+
+static gboolean next_tag (gsize pos, xml_tag_t *tag)
+{
+    const char *str = xml_cache.buf->str, *ptr, *end;
+    char quote = 0;
+    int nest = 0;
+
+    ptr = strchr (str + pos, '<');
+    if (!ptr) return FALSE;
+    tag->start = ptr - str;
+    tag->type = TAG_OTHER;
+
+    if (g_str_has_prefix (ptr, "<!--"))
+    {
+        end = strstr (ptr + 4, "-->");
+        if (!end) return FALSE;
+        tag->end = end + 3 - str;
+    }
+    else if (g_str_has_prefix (ptr, "<![CDATA["))
+    {
+        end = strstr (ptr + 9, "]]>");
+        if (!end) return FALSE;
+        tag->end = end + 3 - str;
+    }
+    else if (ptr[1] == '?')
+    {
+        end = strstr (ptr + 2, "?>");
+        if (!end) return FALSE;
+        tag->end = end + 2 - str;
+    }
+    else if (ptr[1] == '!')
+    {
+        // doctype - may carry an internal subset in brackets
+        for (end = ptr + 2; *end && (*end != '>' || nest); end++)
+        {
+            if (*end == '[') nest++;
+            if (*end == ']') nest--;
+        }
+        if (!*end) return FALSE;
+        tag->end = end + 1 - str;
+    }
+    else
     {
-        if (xmlStrcmp (attr->name, XC ("category"))) xmlUnsetProp (cur_node, attr->name);
+        tag->type = ptr[1] == '/' ? TAG_END : TAG_START;
+        tag->name = ptr - str + (tag->type == TAG_END ? 2 : 1);
+        for (end = str + tag->name; *end && !g_ascii_isspace (*end) && *end != '>' && *end != '/'; end++);
+        tag->name_len = end - str - tag->name;
+
+        // the tag closes at the first > outside a quoted attribute value
+        for (; *end && (quote || *end != '>'); end++)
+        {
+            if (quote) quote = *end == quote ? 0 : quote;
+            else if (*end == '"' || *end == '\'') quote = *end;
+        }
+        if (!*end) return FALSE;
+        if (tag->type == TAG_START && end[-1] == '/') tag->type = TAG_EMPTY;
+        tag->end = end + 1 - str;
     }
+    return TRUE;
+}
 
-    // add or edit the desired element at the current node
-    cptr = g_strdup_printf ("./o:%s", name);
-    xpathObj = xmlXPathNodeEval (cur_node, XC (cptr), xpathCtx);
-    g_free (cptr);
+static gboolean next_attr (gsize pos, xml_attr_t *attr)
+{
+    const char *str = xml_cache.buf->str;
+    char quote;
 
-    if (xmlXPathNodeSetIsEmpty (xpathObj->nodesetval))
-        xmlNewChild (cur_node, NULL, XC (name), XC (val));
-    else
-        xmlNodeSetContent (xpathObj->nodesetval->nodeTab[0], XC (val));
-    xmlXPathFreeObject (xpathObj);
+    // the attribute is taken to start at the whitespace before it, so removing it leaves no gap
+    attr->lead = pos;
+    while (g_ascii_isspace (str[pos])) pos++;
+    if (!str[pos] || str[pos] == '>' || str[pos] == '/') return FALSE;
+
+    attr->name = pos;
+    while (str[pos] && str[pos] != '=' && !g_ascii_isspace (str[pos]) && str[pos] != '>' && str[pos] != '/') pos++;
+    attr->name_len = pos - attr->name;
 
-    // cleanup XML
-    xmlXPathFreeContext (xpathCtx);
-    xmlSaveFormatFile (user_config_file, xDoc, 1);
-    xmlFreeDoc (xDoc);
-    xmlCleanupParser ();
+    while (g_ascii_isspace (str[pos])) pos++;
+    if (str[pos++] != '=') return FALSE;
+    while (g_ascii_isspace (str[pos])) pos++;
+    if (str[pos] != '"' && str[pos] != '\'') return FALSE;
 
-    g_free (user_config_file);
+    quote = str[pos++];
+    attr->val = pos;
+    while (str[pos] && str[pos] != quote) pos++;
+    if (!str[pos]) return FALSE;
+    attr->val_len = pos - attr->val;
+    attr->end = pos + 1;
+    return TRUE;
 }
 
-/*----------------------------------------------------------------------------*/
-/* Exported API */
-/*----------------------------------------------------------------------------*/
+static gboolean name_is (gsize name, gsize len, const char *match)
+{
+    const char *str = xml_cache.buf->str + name, *colon;
 
-static void load_config (void)
+    // compare local names - a namespace prefix is ignored
+    colon = memchr (str, ':', len);
+    if (colon)
+    {
+        len -= colon + 1 - str;
+        str = colon + 1;
+    }
+    return len == strlen (match) && !strncmp (str, match, len);
+}
+
+static gboolean find_element (gsize pos, const char *name, xml_elem_t *elem)
 {
-    char *user_config_file = g_build_filename (g_get_user_config_dir (), "labwc/rc.xml", NULL);
-    char *dir = g_path_get_dirname (user_config_file);
-    int val;
-    float fval;
-    xmlDocPtr xDoc;
-    xmlXPathObjectPtr xpathObj;
-    xmlXPathContextPtr xpathCtx;
-    xmlAttr *attr;
-    xmlChar *cont;
+    xml_tag_t tag;
+    int depth = 0;
 
-    mouse_settings = g_settings_new ("org.gnome.desktop.peripherals.mouse");
-    dclick = g_settings_get_int (mouse_settings, "double-click");
-    if (!dclick) dclick = DEFAULT_MOUSE_DCLICK;
+    // look through the content starting at pos, stopping at the end tag of whatever encloses it
+    while (next_tag (pos, &tag))
+    {
+        pos = tag.end;
+        if (tag.type == TAG_END && depth-- == 0) return FALSE;
+        if (tag.type != TAG_START && tag.type != TAG_EMPTY) continue;
 
-    // labwc default values if nothing set in rc.xml
-    interval = DEFAULT_KB_INTERVAL;
-    delay = DEFAULT_KB_DELAY;
-    speed = DEFAULT_MOUSE_SPEED;
-    left_handed = FALSE;
+        if (depth == 0 && name_is (tag.name, tag.name_len, name))
+        {
+            elem->start = tag.start;
+            elem->name_len = tag.name_len;
+            elem->head_end = tag.end;
+            elem->empty = tag.type == TAG_EMPTY;
+            elem->inner_end = elem->empty ? tag.end : 0;
+            return TRUE;
+        }
+        if (tag.type == TAG_START) depth++;
+    }
+    return FALSE;
+}
 
-    // create the directory if needed
-    g_mkdir_with_parents (dir, S_IRUSR | S_IWUSR | S_IXUSR);
-    g_free (dir);
+static gboolean find_child (const xml_elem_t *parent, const char *name, xml_elem_t *child)
+{
+    if (parent->empty) return FALSE;
+    return find_element (parent->head_end, name, child);
+}
 
-    if (!g_file_test (user_config_file, G_FILE_TEST_IS_REGULAR))
+static gboolean find_close (xml_elem_t *elem)
+{
+    xml_tag_t tag;
+    gsize pos = elem->head_end;
+    int depth = 0;
+
+    // only scan to the end of an element when it is needed - for the root, that is the whole file
+    if (elem->inner_end) return TRUE;
+    while (next_tag (pos, &tag))
     {
-        g_free (user_config_file);
-        return;
+        pos = tag.end;
+        if (tag.type == TAG_START) depth++;
+        else if (tag.type == TAG_END && depth-- == 0)
+        {
+            elem->inner_end = tag.start;
+            return TRUE;
+        }
     }
+    return FALSE;
+}
 
-    // read in data from XML file
-    xmlInitParser ();
-    LIBXML_TEST_VERSION
-    xDoc = xmlReadFile (user_config_file, NULL, XML_PARSE_NOBLANKS);
-    if (xDoc == NULL)
+static gboolean find_node (const char **path, xml_elem_t *node)
+{
+    xml_elem_t child;
+    int i;
+
+    if (!find_element (0, path[0], node)) return FALSE;
+    for (i = 1; path[i]; i++)
     {
-        xmlCleanupParser ();
-        g_free (user_config_file);
-        return;
+        if (find_child (node, path[i], &child)) *node = child;
+        else
+        {
+            // everything after the new element has moved - start again from the top
+            if (!find_close (node)) return FALSE;
+            insert_child (node, path[i], NULL);
+            return find_node (path, node);
+        }
     }
+    return TRUE;
+}
+
+static void insert_child (xml_elem_t *parent, const char *name, const char *val)
+{
+    GString *buf = xml_cache.buf;
+    char *qname, *prefix, *colon, *indent, *elem, *ins;
+    gsize line, pos, close;
 
-    xpathCtx = xmlXPathNewContext (xDoc);
-    xmlXPathRegisterNs (xpathCtx, XC ("o"), XC ("http://openbox.org/3.4/rc"));
+    // new elements take the parent's namespace prefix, if it has one
+    qname = g_strndup (buf->str + parent->start + 1, parent->name_len);
+    colon = strchr (qname, ':');
+    prefix = colon ? g_strndup (qname, colon + 1 - qname) : g_strdup ("");
+    if (val) elem = g_strdup_printf ("<%s%s>%s</%s%s>", prefix, name, val, prefix, name);
+    else elem = g_strdup_printf ("<%s%s/>", prefix, name);
 
-    xpathObj = xmlXPathEvalExpression (XC ("/o:openbox_config/o:keyboard/o:repeatRate"), xpathCtx);
-    if (!xmlXPathNodeSetIsEmpty (xpathObj->nodesetval))
+    // indent one step deeper than the parent
+    for (line = parent->start; line > 0 && buf->str[line - 1] != '\n'; line--);
+    for (pos = line; buf->str[pos] == ' ' || buf->str[pos] == '\t'; pos++);
+    indent = g_strndup (buf->str + line, pos - line);
+
+    // <parent/> has nowhere to put a child - open it up first
+    close = parent->inner_end;
+    if (parent->empty)
     {
-        cont = xmlNodeGetContent (xpathObj->nodesetval->nodeTab[0]);
-        if (sscanf ((const char *) cont, "%d", &val) == 1 && val > 0) interval = 1000 / val;
-        xmlFree (cont);
+        for (pos = parent->head_end - 2; pos > 0 && g_ascii_isspace (buf->str[pos - 1]); pos--);
+        g_string_erase (buf, pos, parent->head_end - pos);
+        ins = g_strdup_printf ("></%s>", qname);
+        g_string_insert (buf, pos, ins);
+        g_free (ins);
+        close = pos + 1;
     }
-    xmlXPathFreeObject (xpathObj);
 
-    xpathObj = xmlXPathEvalExpression (XC ("/o:openbox_config/o:keyboard/o:repeatDelay"), xpathCtx);
-    if (!xmlXPathNodeSetIsEmpty (xpathObj->nodesetval))
+    // if the end tag is on a line of its own, add the child on a new line above it
+    for (line = close; line > 0 && (buf->str[line - 1] == ' ' || buf->str[line - 1] == '\t'); line--);
+    if (line > 0 && buf->str[line - 1] == '\n')
     {
-        cont = xmlNodeGetContent (xpathObj->nodesetval->nodeTab[0]);
-        if (sscanf ((const char *) cont, "%d", &val) == 1 && val > 0) delay = val;
-        xmlFree (cont);
+        ins = g_strdup_printf ("%s  %s\n", indent, elem);
+        g_string_insert (buf, line, ins);
     }
-    xmlXPathFreeObject (xpathObj);
+    else
+    {
+        ins = g_strdup_printf ("\n%s  %s\n%s", indent, elem, indent);
+        g_string_insert (buf, close, ins);
+    }
+    xml_cache.dirty = TRUE;
+
+    g_free (ins);
+    g_free (indent);
+    g_free (elem);
+    g_free (prefix);
+    g_free (qname);
+}
+
+static void replace_content (xml_elem_t *elem, const char *val)
+{
+    GString *buf = xml_cache.buf;
+    char *qname, *str;
+
+    if (elem->empty)
+    {
+        // <name/> becomes <name>val</name>
+        qname = g_strndup (buf->str + elem->start + 1, elem->name_len);
+        str = g_strdup_printf ("<%s>%s</%s>", qname, val, qname);
+        g_string_erase (buf, elem->start, elem->head_end - elem->start);
+        g_string_insert (buf, elem->start, str);
+        g_free (str);
+        g_free (qname);
+        xml_cache.dirty = TRUE;
+        return;
+    }
+
+    // only the bytes between the tags are touched, and only if they differ
+    if (!find_close (elem)) return;
+    if (elem->inner_end - elem->head_end == strlen (val) && !strncmp (buf->str + elem->head_end, val, strlen (val))) return;
+    g_string_erase (buf, elem->head_end, elem->inner_end - elem->head_end);
+    g_string_insert (buf, elem->head_end, val);
+    xml_cache.dirty = TRUE;
+}
+
+static gboolean fix_attributes (const xml_elem_t *elem, gboolean category)
+{
+    GString *buf = xml_cache.buf;
+    xml_attr_t attr;
+    gboolean changed = FALSE, has_category = FALSE;
+    gsize pos = elem->start + 1 + elem->name_len;
 
-    xpathObj = xmlXPathEvalExpression (XC ("/o:openbox_config/o:keyboard"), xpathCtx);
-    if (!xmlXPathNodeSetIsEmpty (xpathObj->nodesetval))
+    // remove everything but the category and namespace declarations, in place
+    while (next_attr (pos, &attr))
     {
-        for (attr = xpathObj->nodesetval->nodeTab[0]->properties; attr; attr = attr->next)
+        if (name_is (attr.name, attr.name_len, "category") && !memchr (buf->str + attr.name, ':', attr.name_len))
         {
-            cont = attr->children->content;
-            if (!xmlStrcmp (attr->name, XC ("repeatRate")))
-                if (sscanf ((const char *) cont, "%d", &val) == 1 && val > 0) interval = 1000 / val;
-            if (!xmlStrcmp (attr->name, XC ("repeatDelay")))
-                if (sscanf ((const char *) cont, "%d", &val) == 1 && val > 0) delay = val;
+            has_category = TRUE;
+            if (category && (attr.val_len != 7 || strncmp (buf->str + attr.val, "default", 7)))
+            {
+                g_string_erase (buf, attr.val, attr.val_len);
+                g_string_insert (buf, attr.val, "default");
+                attr.end = attr.val + 8;
+                changed = TRUE;
+            }
+            pos = attr.end;
+        }
+        else if (!strncmp (buf->str + attr.name, "xmlns", 5)) pos = attr.end;
+        else
+        {
+            g_string_erase (buf, attr.lead, attr.end - attr.lead);
+            changed = TRUE;
         }
     }
-    xmlXPathFreeObject (xpathObj);
 
-    xpathObj = xmlXPathEvalExpression (XC ("/o:openbox_config/o:libinput/o:device/o:pointerSpeed"), xpathCtx);
-    if (!xmlXPathNodeSetIsEmpty (xpathObj->nodesetval))
+    // libinput device nodes require the category property to be set...
+    if (category && !has_category)
     {
-        cont = xmlNodeGetContent (xpathObj->nodesetval->nodeTab[0]);
-        if (sscanf ((const char *) cont, "%f", &fval) == 1) speed = fval;
-        xmlFree (cont);
+        g_string_insert (buf, elem->start + 1 + elem->name_len, " category=\"default\"");
+        changed = TRUE;
     }
-    xmlXPathFreeObject (xpathObj);
 
-    xpathObj = xmlXPathEvalExpression (XC ("/o:openbox_config/o:libinput/o:device/o:leftHanded"), xpathCtx);
-    if (!xmlXPathNodeSetIsEmpty (xpathObj->nodesetval))
+    if (changed) xml_cache.dirty = TRUE;
+    return changed;
+}
+
+static gboolean xml_cache_current (void)
+{
+    if (!xml_cache.buf || !xml_cache.valid) return FALSE;
+    return stamp_current (xml_cache.file, &xml_cache.stamp);
+}
+
+static void xml_cache_load (void)
+{
+    xml_elem_t root;
+    char *contents;
+    gsize len;
+    gint64 span;
+
+    if (!xml_cache.file) xml_cache.file = g_build_filename (g_get_user_config_dir (), "labwc/rc.xml", NULL);
+
+    // discard any stale copy
+    if (xml_cache.buf) g_string_free (xml_cache.buf, TRUE);
+    xml_cache.buf = NULL;
+
+    // what is on disk is not known until it is first committed over
+    xml_cache.hash.valid = FALSE;
+
+    // read in the bytes of the file - it is edited in place, never parsed into a document
+    stamp_file (xml_cache.file, &xml_cache.stamp);
+    span = trace_begin ();
+    if (xml_cache.stamp.exists && g_file_get_contents (xml_cache.file, &contents, &len, NULL))
     {
-        cont = xmlNodeGetContent (xpathObj->nodesetval->nodeTab[0]);
-        left_handed = is_true (cont);
-        xmlFree (cont);
+        xml_cache.buf = g_string_new_len (contents, len);
+        g_free (contents);
     }
-    xmlXPathFreeObject (xpathObj);
+    else xml_cache.buf = g_string_new (NULL);
+    trace_end ("read rc.xml", span);
+
+    // check that the root node exists - start a new file if not
+    if (!find_element (0, "openbox_config", &root)) g_string_assign (xml_cache.buf, RC_XML_SKELETON);
 
-    xpathObj = xmlXPathEvalExpression (XC ("/o:openbox_config/o:libinput/o:device"), xpathCtx);
-    if (!xmlXPathNodeSetIsEmpty (xpathObj->nodesetval))
+    xml_cache.valid = TRUE;
+}
+
+static void on_config_changed (GFileMonitor *monitor, GFile *file, GFile *other, GFileMonitorEvent event, gpointer data)
+{
+    // don't block the main loop on an edit in progress - the stamp is checked again before the next one
+    if (!g_mutex_trylock (&xml_cache.lock)) return;
+
+    // another tool has written the file - our own writes leave the stamp matching
+    if (!xml_cache_current ()) xml_cache.valid = FALSE;
+    g_mutex_unlock (&xml_cache.lock);
+}
+
+static void on_dclick_changed (GSettings *settings, const char *key, gpointer data)
+{
+    // our own writes leave the value matching the one last stored
+    if (g_settings_get_int (settings, key) != dclick_stored) dclick_stale = TRUE;
+}
+
+static void begin_xml_edit (void)
+{
+    // the edit may be on the apply thread - hold the cache until it is committed
+    g_mutex_lock (&xml_cache.lock);
+
+    // only re-read if the file has changed since it was last read or written
+    if (!xml_cache_current ()) xml_cache_load ();
+    xml_cache.dirty = FALSE;
+
+    // if the loaded values still match the file, they still will once this edit is written
+    xml_cache.read_fresh = stamp_current (xml_cache.file, &xml_cache.read_stamp);
+}
+
+static void set_xml_value (const char *lvl1, const char *lvl2, const char *name, const char *val)
+{
+    const char *path[4] = { "openbox_config", lvl1, lvl2, NULL };
+    xml_elem_t node, child;
+    char *esc;
+
+    // stage the edit in the cached bytes - caller must have begun an edit
+    if (!xml_cache.buf) return;
+
+    // find the keyboard / mouse / libinput node, and libinput device if required - missing ones are created
+    if (!find_node (path, &node)) return;
+
+    // clear any node attributes - the rest of the tag is left as it was
+    if (fix_attributes (&node, lvl2 != NULL) && !find_node (path, &node)) return;
+
+    // add or edit the desired element at the current node
+    esc = g_markup_escape_text (val, -1);
+    if (find_child (&node, name, &child)) replace_content (&child, esc);
+    else if (find_close (&node)) insert_child (&node, name, esc);
+    g_free (esc);
+}
+
+static void commit_xml_edit (void)
+{
+    gboolean changed = FALSE;
+    gint64 span;
+    int len;
+
+    // write out all staged edits at once, then reload the compositor once - if the file really changed
+    if (xml_cache.dirty)
     {
-        for (attr = xpathObj->nodesetval->nodeTab[0]->properties; attr; attr = attr->next)
+        span = trace_begin ();
+        len = commit_file (xml_cache.file, xml_cache.buf->str, xml_cache.buf->len, &xml_cache.hash);
+        trace_end ("write rc.xml", span);
+
+        if (len < 0) xml_cache.valid = FALSE;
+        else if (len > 0)
         {
-            cont = attr->children->content;
-            if (!xmlStrcmp (attr->name, XC ("pointerSpeed")))
-                if (sscanf ((const char *) cont, "%f", &fval) == 1) speed = fval;
-            if (!xmlStrcmp (attr->name, XC ("leftHanded")))
-                left_handed = is_true (cont);
+            stamp_file (xml_cache.file, &xml_cache.stamp);
+            if (xml_cache.read_fresh) xml_cache.read_stamp = xml_cache.stamp;
+            changed = TRUE;
         }
+        xml_cache.dirty = FALSE;
     }
-    xmlXPathFreeObject (xpathObj);
+    g_mutex_unlock (&xml_cache.lock);
 
-    // cleanup XML
-    xmlXPathFreeContext (xpathCtx);
-    xmlFreeDoc (xDoc);
-    xmlCleanupParser ();
+    if (changed) request_reload ();
+}
 
-    g_free (user_config_file);
+static gboolean is_labwc (pid_t pid)
+{
+    char *path, *comm;
+    gboolean res = FALSE;
+
+    path = g_strdup_printf ("/proc/%d/comm", pid);
+    if (g_file_get_contents (path, &comm, NULL, NULL))
+    {
+        res = !g_strcmp0 (g_strstrip (comm), "labwc");
+        g_free (comm);
+    }
+    g_free (path);
+    return res;
+}
+
+static pid_t find_compositor (void)
+{
+    const char *env, *name;
+    char *path;
+    GStatBuf st;
+    GDir *dir;
+    pid_t pid;
+
+    // labwc exports its own pid to everything it launches
+    env = g_getenv ("LABWC_PID");
+    if (env && sscanf (env, "%d", &pid) == 1 && pid > 0 && is_labwc (pid)) return pid;
+
+    // otherwise look for a labwc process belonging to this user
+    dir = g_dir_open ("/proc", 0, NULL);
+    if (!dir) return 0;
+    while ((name = g_dir_read_name (dir)))
+    {
+        if (sscanf (name, "%d", &pid) != 1 || pid <= 0) continue;
+        path = g_build_filename ("/proc", name, NULL);
+        if (!g_stat (path, &st) && st.st_uid == getuid () && is_labwc (pid))
+        {
+            g_free (path);
+            g_dir_close (dir);
+            return pid;
+        }
+        g_free (path);
+    }
+    g_dir_close (dir);
+    return 0;
+}
+
+static void send_reload (void)
+{
+    gint64 span = trace_begin ();
+
+    // equivalent to labwc -r, without forking a shell and a second labwc to do it
+    if (!labwc_pid || kill (labwc_pid, 0) || !is_labwc (labwc_pid)) labwc_pid = find_compositor ();
+    if (labwc_pid) kill (labwc_pid, SIGHUP);
+
+    trace_end ("reload labwc", span);
+}
+
+static gboolean reload_handler (gpointer data)
+{
+    g_mutex_lock (&reload_lock);
+    reload_timer = 0;
+    g_mutex_unlock (&reload_lock);
+
+    send_reload ();
+    return FALSE;
+}
+
+static void request_reload (void)
+{
+    static int window = -1;
+    const char *env;
+    GSource *source;
+
+    g_mutex_lock (&reload_lock);
+    if (window < 0)
+    {
+        env = g_getenv ("RASPUTIN_RELOAD_MS");
+        if (!env || sscanf (env, "%d", &window) != 1 || window < 0) window = DEFAULT_RELOAD_MS;
+    }
+
+    if (!window)
+    {
+        g_mutex_unlock (&reload_lock);
+        send_reload ();
+        return;
+    }
+
+    // the first request in a window starts the timer - later ones are merged into it
+    if (!reload_timer)
+    {
+        source = g_timeout_source_new (window);
+        g_source_set_callback (source, reload_handler, NULL, NULL);
+        reload_timer = g_source_attach (source, NULL);
+        g_source_unref (source);
+    }
+    g_mutex_unlock (&reload_lock);
+}
+
+static void flush_reload (void)
+{
+    gboolean pending;
+
+    g_mutex_lock (&reload_lock);
+    pending = reload_timer != 0;
+    if (pending) g_source_remove (reload_timer);
+    reload_timer = 0;
+    g_mutex_unlock (&reload_lock);
+
+    if (pending) send_reload ();
+}
+
+/*----------------------------------------------------------------------------*/
+/* Exported API */
+/*----------------------------------------------------------------------------*/
+
+static void load_config (void)
+{
+    char *dir;
+    GFile *file;
+
+    if (!mouse_settings)
+    {
+        // hold writes back until a batch is complete, so they reach dconf together
+        mouse_settings = g_settings_new ("org.gnome.desktop.peripherals.mouse");
+        g_settings_delay (mouse_settings);
+        g_signal_connect (mouse_settings, "changed::double-click", G_CALLBACK (on_dclick_changed), NULL);
+    }
+    dclick_stored = g_settings_get_int (mouse_settings, "double-click");
+    dclick_stale = FALSE;
+    dclick = dclick_stored ? dclick_stored : DEFAULT_MOUSE_DCLICK;
+
+    // labwc default values if nothing set in rc.xml
+    interval = DEFAULT_KB_INTERVAL;
+    delay = DEFAULT_KB_DELAY;
+    speed = DEFAULT_MOUSE_SPEED;
+    left_handed = FALSE;
+
+    if (!xml_cache.file) xml_cache.file = g_build_filename (g_get_user_config_dir (), "labwc/rc.xml", NULL);
+
+    // create the directory if needed
+    dir = g_path_get_dirname (xml_cache.file);
+    g_mkdir_with_parents (dir, S_IRUSR | S_IWUSR | S_IXUSR);
+    g_free (dir);
+
+    // watch for other tools writing the file, so the cached document is not reused
+    if (!xml_cache.monitor)
+    {
+        file = g_file_new_for_path (xml_cache.file);
+        xml_cache.monitor = g_file_monitor_file (file, G_FILE_MONITOR_NONE, NULL, NULL);
+        if (xml_cache.monitor) g_signal_connect (xml_cache.monitor, "changed", G_CALLBACK (on_config_changed), NULL);
+        g_object_unref (file);
+    }
+
+    // note the file before reading it, so a write during the read leaves the values stale
+    g_mutex_lock (&xml_cache.lock);
+    stamp_file (xml_cache.file, &xml_cache.read_stamp);
+    g_mutex_unlock (&xml_cache.lock);
+
+    // the values are read without building a document - that is only parsed when the first edit is made
+    xmlInitParser ();
+    LIBXML_TEST_VERSION
+    read_rc_xml ();
+}
+
+static gboolean config_current (void)
+{
+    gboolean res;
+
+    // the values last loaded stand until gsettings reports another double-click time or rc.xml is written by another tool
+    if (!mouse_settings || dclick_stale) return FALSE;
+
+    g_mutex_lock (&xml_cache.lock);
+    res = xml_cache.file && stamp_current (xml_cache.file, &xml_cache.read_stamp);
+    g_mutex_unlock (&xml_cache.lock);
+    return res;
+}
+
+static void free_config (void)
+{
+    // send any reload still waiting for its window to close, and anything gsettings has not yet written
+    flush_reload ();
+    if (mouse_settings)
+    {
+        g_settings_apply (mouse_settings);
+        g_settings_sync ();
+    }
+    g_clear_object (&mouse_settings);
+    free_snapshot (&rc_snapshot);
+
+    // stop watching the file - in plugin mode the handler goes away with the module
+    g_mutex_lock (&xml_cache.lock);
+    if (xml_cache.monitor) g_signal_handlers_disconnect_by_func (xml_cache.monitor, on_config_changed, NULL);
+    g_clear_object (&xml_cache.monitor);
+    if (xml_cache.buf) g_string_free (xml_cache.buf, TRUE);
+    xml_cache.buf = NULL;
+    g_clear_pointer (&xml_cache.file, g_free);
+    xml_cache.valid = FALSE;
+    g_mutex_unlock (&xml_cache.lock);
 }
 
 static gboolean is_true (const xmlChar *val)
@@ -286,48 +927,93 @@ static gboolean is_true (const xmlChar *val)
 
 static void set_doubleclick (void)
 {
-    char *str;
-
-    g_settings_set_int (mouse_settings, "double-click", dclick);
-
-    str = g_strdup_printf ("%d", dclick);
-    set_xml_value ("mouse", NULL, "doubleClickTime", str);
-    g_free (str);
-
-    system ("labwc -r");
+    set_many (KM_MASK (KM_DCLICK));
 }
 
 static void set_speed (void)
 {
-    char *str;
+    set_many (KM_MASK (KM_SPEED));
+}
 
-    str = g_strdup_printf ("%f", speed);
-    set_xml_value ("libinput", "device", "pointerSpeed", str);
-    g_free (str);
+static void set_keyboard (void)
+{
+    set_many (KM_MASK (KM_KEYBOARD));
+}
 
-    system ("labwc -r");
+static void set_lefthanded (void)
+{
+    set_many (KM_MASK (KM_LEFTHANDED));
 }
 
-static void set_keyboard (void)
+static void set_many (guint settings)
 {
-    char *str;
+    char *str, sbuf[G_ASCII_DTOSTR_BUF_SIZE];
+
+    if (settings & KM_MASK (KM_DCLICK))
+    {
+        dclick_stored = dclick;
+        g_settings_set_int (mouse_settings, "double-click", dclick);
+    }
 
-    str = g_strdup_printf ("%d", 1000 / interval);
-    set_xml_value ("keyboard", NULL, "repeatRate", str);
-    g_free (str);
+    // stage every value, then write rc.xml and reload the compositor once
+    begin_xml_edit ();
 
-    str = g_strdup_printf ("%d", delay);
-    set_xml_value ("keyboard", NULL, "repeatDelay", str);
-    g_free (str);
+    if (settings & KM_MASK (KM_DCLICK))
+    {
+        str = g_strdup_printf ("%d", dclick);
+        set_xml_value ("mouse", NULL, "doubleClickTime", str);
+        g_free (str);
+    }
+
+    // the speed is written in the C locale whatever the caller's, as openbox does
+    if (settings & KM_MASK (KM_SPEED))
+        set_xml_value ("libinput", "device", "pointerSpeed", g_ascii_formatd (sbuf, sizeof (sbuf), "%f", speed));
+
+    if (settings & KM_MASK (KM_KEYBOARD))
+    {
+        str = g_strdup_printf ("%d", 1000 / interval);
+        set_xml_value ("keyboard", NULL, "repeatRate", str);
+        g_free (str);
 
-    system ("labwc -r");
+        str = g_strdup_printf ("%d", delay);
+        set_xml_value ("keyboard", NULL, "repeatDelay", str);
+        g_free (str);
+    }
+
+    if (settings & KM_MASK (KM_LEFTHANDED))
+        set_xml_value ("libinput", "device", "leftHanded", left_handed ? "yes" : "no");
+
+    commit_xml_edit ();
+    if (settings & KM_MASK (KM_DCLICK)) g_settings_apply (mouse_settings);
 }
 
-static void set_lefthanded (void)
+static void snapshot (void)
 {
-    set_xml_value ("libinput", "device", "leftHanded", left_handed ? "yes" : "no");
+    g_mutex_lock (&xml_cache.lock);
+    snapshot_file (&rc_snapshot, xml_cache.file);
+    g_mutex_unlock (&xml_cache.lock);
+
+    dclick_snapshot = g_settings_get_int (mouse_settings, "double-click");
+}
+
+static void restore (void)
+{
+    int res;
+
+    if (g_settings_get_int (mouse_settings, "double-click") != dclick_snapshot)
+    {
+        dclick_stored = dclick_snapshot;
+        g_settings_set_int (mouse_settings, "double-click", dclick_snapshot);
+        g_settings_apply (mouse_settings);
+    }
+
+    // put the original file back in one write - the cache is re-read before any later edit
+    g_mutex_lock (&xml_cache.lock);
+    res = restore_file (&rc_snapshot);
+    if (res) xml_cache.valid = FALSE;
+    g_mutex_unlock (&xml_cache.lock);
 
-    system ("labwc -r");
+    if (res > 0) request_reload ();
 }
 
 /*----------------------------------------------------------------------------*/
@@ -336,10 +1022,15 @@ static void set_lefthanded (void)
 
 km_functions_t labwc_ifunctions = {
     .load_config = load_config,
+    .config_current = config_current,
+    .free_config = free_config,
     .set_doubleclick = set_doubleclick,
     .set_speed = set_speed,
     .set_keyboard = set_keyboard,
     .set_lefthanded = set_lefthanded,
+    .set_many = set_many,
+    .snapshot = snapshot,
+    .restore = restore,
 };
 
 /* End of file */
@@ -26,8 +26,14 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 ============================================================================*/
 
 #include <locale.h>
-#include <gtk/gtk.h>
+#include <gio/gio.h>
 #include <glib/gi18n.h>
+#include <glib/gstdio.h>
+#include <glib-unix.h>
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/XKBlib.h>
+#include <X11/extensions/XInput2.h>
 
 #include "rasputin.h"
 
@@ -42,70 +48,564 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define DEFAULT_MOUSE_SPEED 0.0
 #define DEFAULT_MOUSE_DCLICK 250
 
+#define XI_PROP_SPEED "libinput Accel Speed"
+#define XI_PROP_LEFT "libinput Left Handed Enabled"
+
+/* Input device as reported by the X server */
+typedef struct {
+    int id;
+    char *name;
+    int use;
+    gboolean has_speed;
+    float speed;
+    gboolean has_left_handed;
+    gboolean left_handed;
+} xi_device_t;
+
+/* lxsession desktop.conf, kept between edits - the user file is written, the system one only read,
+   exists says whether the user key file was loaded from the user file or seeded from the system one,
+   and loads counts the times the files have been read */
+typedef struct {
+    char *file, *sys_file;
+    GKeyFile *user, *sys;
+    file_stamp_t stamp, sys_stamp;
+    commit_hash_t hash;
+    guint loads;
+    gboolean exists;
+    gboolean valid;
+    gboolean dirty;
+    GMutex lock;
+} kf_cache_t;
+
 /*----------------------------------------------------------------------------*/
 /* Global data */
 /*----------------------------------------------------------------------------*/
 
+static Display *dpy = NULL;
+static int xi_opcode;
+static Atom speed_atom, left_atom, float_atom;
+static XErrorHandler old_handler;
+
+/* Device table - shared between the apply thread and hotplug events on the main loop */
+static GMutex xi_lock;
 static GList *devs = NULL;
+static guint xi_watch;
+
+/* Values most recently written, applied to devices as they appear */
+static float cur_speed;
+static gboolean cur_left_handed;
+
+static kf_cache_t kf_cache;
+static guint read_loads;
+
+/* State when the panel was opened, for restore */
+static file_snapshot_t lxsession_snapshot, autostart_snapshot, legacy_snapshot;
+static float speed_snapshot;
+static gboolean left_handed_snapshot;
+static unsigned int delay_snapshot, interval_snapshot;
+static gboolean repeat_snapshot;
 
 /*----------------------------------------------------------------------------*/
 /* Function prototypes */
 /*----------------------------------------------------------------------------*/
 
+static int xi_error (Display *disp, XErrorEvent *ev);
+static gboolean xi_open (void);
+static gboolean xi_get_float (int id, Atom prop, float *val);
+static gboolean xi_get_bool (int id, Atom prop, gboolean *val);
+static void xi_set_float (int id, Atom prop, float val);
+static void xi_set_bool (int id, Atom prop, gboolean val);
+static gboolean core_swapped (void);
+static void write_devices (gboolean set_speed, gboolean set_left);
+static void write_repeat (unsigned int rdelay, unsigned int rinterval);
+static void reload_xsettings (void);
+static void free_device (gpointer data);
+static xi_device_t *probe_device (XIDeviceInfo *info);
+static void remove_device (int id);
+static void add_device (int id);
+static void hierarchy_changed (XIHierarchyEvent *ev);
+static void process_events (void);
+static gboolean xi_events (gint fd, GIOCondition condition, gpointer data);
+static void watch_devices (void);
 static void read_speed (void);
+static gboolean kf_cache_current (void);
+static void kf_cache_load (void);
+static void kf_cache_free (void);
+static void begin_kf_edit (void);
+static void set_kf_value (const char *section, const char *item, const char *val);
+static gboolean commit_kf_edit (void);
 static int read_key_file_int (GKeyFile *user, GKeyFile *sys, const char *section, const char *item, int fallback);
 static void read_lxsession (void);
-static void write_lxsession (const char *section, const char *param, int value);
+static gboolean read_stored_speed (float *val);
+static void write_autostart (void);
 static void load_config (void);
+static gboolean config_current (void);
+static void free_config (void);
+static void apply_config (void);
 static void set_doubleclick (void);
 static void set_speed (void);
 static void set_keyboard (void);
 static void set_lefthanded (void);
+static void set_many (guint settings);
+static void snapshot (void);
+static void restore (void);
 
 /*----------------------------------------------------------------------------*/
 /* Helper functions */
 /*----------------------------------------------------------------------------*/
 
+static int xi_error (Display *disp, XErrorEvent *ev)
+{
+    // a device can go away between being listed and being written - ignore errors on our own connection
+    if (disp == dpy) return 0;
+    return old_handler ? old_handler (disp, ev) : 0;
+}
+
+static gboolean xi_open (void)
+{
+    int event, error, major = 2, minor = 0;
+
+    if (dpy) return TRUE;
+
+    // use a private connection, so the backend can be used without GTK and off the main thread
+    dpy = XOpenDisplay (NULL);
+    if (!dpy) return FALSE;
+
+    if (!XQueryExtension (dpy, "XInputExtension", &xi_opcode, &event, &error)
+        || XIQueryVersion (dpy, &major, &minor) != Success)
+    {
+        XCloseDisplay (dpy);
+        dpy = NULL;
+        return FALSE;
+    }
+
+    old_handler = XSetErrorHandler (xi_error);
+
+    speed_atom = XInternAtom (dpy, XI_PROP_SPEED, False);
+    left_atom = XInternAtom (dpy, XI_PROP_LEFT, False);
+    float_atom = XInternAtom (dpy, "FLOAT", False);
+    return TRUE;
+}
+
+static gboolean xi_get_float (int id, Atom prop, float *val)
+{
+    Atom type;
+    int format;
+    unsigned long nitems, bytes_after;
+    unsigned char *data;
+    gboolean res = FALSE;
+
+    if (XIGetProperty (dpy, id, prop, 0, 1, False, float_atom, &type, &format, &nitems, &bytes_after, &data) != Success)
+        return FALSE;
+
+    if (type == float_atom && format == 32 && nitems >= 1)
+    {
+        *val = *((float *) data);
+        res = TRUE;
+    }
+    XFree (data);
+    return res;
+}
+
+static gboolean xi_get_bool (int id, Atom prop, gboolean *val)
+{
+    Atom type;
+    int format;
+    unsigned long nitems, bytes_after;
+    unsigned char *data;
+    gboolean res = FALSE;
+
+    if (XIGetProperty (dpy, id, prop, 0, 1, False, XA_INTEGER, &type, &format, &nitems, &bytes_after, &data) != Success)
+        return FALSE;
+
+    if (type == XA_INTEGER && format == 8 && nitems >= 1)
+    {
+        *val = data[0] != 0;
+        res = TRUE;
+    }
+    XFree (data);
+    return res;
+}
+
+static void xi_set_float (int id, Atom prop, float val)
+{
+    XIChangeProperty (dpy, id, prop, float_atom, 32, PropModeReplace, (unsigned char *) &val, 1);
+}
+
+static void xi_set_bool (int id, Atom prop, gboolean val)
+{
+    unsigned char data = val ? 1 : 0;
+
+    XIChangeProperty (dpy, id, prop, XA_INTEGER, 8, PropModeReplace, &data, 1);
+}
+
+static gboolean core_swapped (void)
+{
+    unsigned char map[8];
+
+    // lxsession makes the pointer left-handed by swapping the core buttons, which libinput's own swap would undo
+    return XGetPointerMapping (dpy, map, sizeof (map)) >= 3 && map[0] == 3;
+}
+
+static void write_devices (gboolean set_speed, gboolean set_left)
+{
+    xi_device_t *dev;
+    GList *l;
+    gboolean lval = FALSE;
+    gint64 span = trace_begin ();
+
+    g_mutex_lock (&xi_lock);
+    if (set_speed) cur_speed = speed;
+    if (set_left && left_handed == cur_left_handed) set_left = FALSE;
+    if (set_left) cur_left_handed = left_handed;
+    if (!dpy)
+    {
+        g_mutex_unlock (&xi_lock);
+        return;
+    }
+
+    // the device property is only the difference between the handedness wanted and what the core map gives
+    if (set_left) lval = left_handed != core_swapped ();
+
+    // queue the property changes for every device, then send them all in one round-trip
+    for (l = devs; l != NULL; l = l->next)
+    {
+        dev = (xi_device_t *) l->data;
+        if (set_speed && dev->has_speed)
+        {
+            xi_set_float (dev->id, speed_atom, speed);
+            dev->speed = speed;
+        }
+        if (set_left && dev->has_left_handed && dev->left_handed != lval)
+        {
+            xi_set_bool (dev->id, left_atom, lval);
+            dev->left_handed = lval;
+        }
+    }
+    XSync (dpy, False);
+
+    // the sync may have queued hotplug events without the socket becoming readable again
+    process_events ();
+    g_mutex_unlock (&xi_lock);
+
+    trace_end ("write xinput properties", span);
+}
+
+static void write_repeat (unsigned int rdelay, unsigned int rinterval)
+{
+    gint64 span = trace_begin ();
+
+    // the core keyboard takes the new rate at once - lxsession only reads the stored one at login
+    g_mutex_lock (&xi_lock);
+    if (dpy)
+    {
+        XkbSetAutoRepeatRate (dpy, XkbUseCoreKbd, rdelay, rinterval);
+        XSync (dpy, False);
+        process_events ();
+    }
+    g_mutex_unlock (&xi_lock);
+
+    trace_end ("write xkb repeat rate", span);
+}
+
+static void reload_xsettings (void)
+{
+    XEvent ev;
+
+    // ask lxsession to re-read desktop.conf, so its XSETTINGS manager passes the new values to running applications
+    g_mutex_lock (&xi_lock);
+    if (dpy)
+    {
+        memset (&ev, 0, sizeof (ev));
+        ev.xclient.type = ClientMessage;
+        ev.xclient.window = DefaultRootWindow (dpy);
+        ev.xclient.message_type = XInternAtom (dpy, "_LXSESSION", False);
+        ev.xclient.format = 8;
+        ev.xclient.data.b[0] = 0;
+        XSendEvent (dpy, DefaultRootWindow (dpy), False, SubstructureRedirectMask | SubstructureNotifyMask, &ev);
+        XFlush (dpy);
+    }
+    g_mutex_unlock (&xi_lock);
+}
+
+static void free_device (gpointer data)
+{
+    xi_device_t *dev = (xi_device_t *) data;
+
+    g_free (dev->name);
+    g_free (dev);
+}
+
+static xi_device_t *probe_device (XIDeviceInfo *info)
+{
+    xi_device_t *dev;
+
+    if (info->use != XISlavePointer) return NULL;
+
+    dev = g_new0 (xi_device_t, 1);
+    dev->id = info->deviceid;
+    dev->name = g_strdup (info->name);
+    dev->use = info->use;
+    dev->has_speed = xi_get_float (dev->id, speed_atom, &dev->speed);
+    dev->has_left_handed = xi_get_bool (dev->id, left_atom, &dev->left_handed);
+    return dev;
+}
+
+static void remove_device (int id)
+{
+    GList *l;
+
+    for (l = devs; l != NULL; l = l->next)
+    {
+        if (((xi_device_t *) l->data)->id == id)
+        {
+            free_device (l->data);
+            devs = g_list_delete_link (devs, l);
+            return;
+        }
+    }
+}
+
+static void add_device (int id)
+{
+    XIDeviceInfo *info;
+    xi_device_t *dev;
+    gboolean lval;
+    int ndevs;
+
+    // properties may only appear once the device is enabled, so always re-read them
+    remove_device (id);
+
+    info = XIQueryDevice (dpy, id, &ndevs);
+    if (!info) return;
+    dev = ndevs == 1 ? probe_device (info) : NULL;
+    XIFreeDeviceInfo (info);
+    if (!dev) return;
+
+    // bring the new device into line with the current settings
+    if (dev->has_speed && dev->speed != cur_speed)
+    {
+        xi_set_float (dev->id, speed_atom, cur_speed);
+        dev->speed = cur_speed;
+    }
+    lval = cur_left_handed != core_swapped ();
+    if (dev->has_left_handed && dev->left_handed != lval)
+    {
+        xi_set_bool (dev->id, left_atom, lval);
+        dev->left_handed = lval;
+    }
+    devs = g_list_append (devs, dev);
+}
+
+static void hierarchy_changed (XIHierarchyEvent *ev)
+{
+    int i;
+
+    for (i = 0; i < ev->num_info; i++)
+    {
+        if (ev->info[i].flags & (XISlaveRemoved | XIDeviceDisabled | XISlaveDetached))
+            remove_device (ev->info[i].deviceid);
+        else if (ev->info[i].flags & (XISlaveAdded | XIDeviceEnabled | XISlaveAttached))
+            add_device (ev->info[i].deviceid);
+    }
+    XFlush (dpy);
+}
+
+static void process_events (void)
+{
+    XEvent ev;
+    XGenericEventCookie *cookie = &ev.xcookie;
+
+    // caller must hold xi_lock
+    while (dpy && XPending (dpy))
+    {
+        XNextEvent (dpy, &ev);
+        if (cookie->type != GenericEvent || cookie->extension != xi_opcode) continue;
+        if (!XGetEventData (dpy, cookie)) continue;
+        if (cookie->evtype == XI_HierarchyChanged) hierarchy_changed ((XIHierarchyEvent *) cookie->data);
+        XFreeEventData (dpy, cookie);
+    }
+}
+
+static gboolean xi_events (gint fd, GIOCondition condition, gpointer data)
+{
+    g_mutex_lock (&xi_lock);
+    process_events ();
+    g_mutex_unlock (&xi_lock);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void watch_devices (void)
+{
+    XIEventMask evmask;
+    unsigned char mask[XIMaskLen (XI_HierarchyChanged)] = { 0 };
+
+    if (!dpy || xi_watch) return;
+
+    // ask for device add / remove events, and handle them from the main loop
+    XISetMask (mask, XI_HierarchyChanged);
+    evmask.deviceid = XIAllDevices;
+    evmask.mask_len = sizeof (mask);
+    evmask.mask = mask;
+    XISelectEvents (dpy, DefaultRootWindow (dpy), &evmask, 1);
+    XFlush (dpy);
+
+    xi_watch = g_unix_fd_add (ConnectionNumber (dpy), G_IO_IN, xi_events, NULL);
+}
+
 static void read_speed (void)
 {
-    FILE *fp_dev, *fp_acc;
-    char *cmd, dev[16], acc[32];
-    char *oldloc = setlocale (LC_NUMERIC, NULL);
-    float fval;
+    XIDeviceInfo *info;
+    xi_device_t *dev;
+    gboolean swapped;
+    int i, ndevs;
+    gint64 span;
 
-    setlocale (LC_NUMERIC, "POSIX");
     speed = DEFAULT_MOUSE_SPEED;
+    span = trace_begin ();
+    if (!xi_open ()) return;
+
+    // the devices are left-handed either through the core button map or through their own property
+    swapped = core_swapped ();
+    cur_left_handed = swapped;
+
+    // query the server for the slave pointer devices and their libinput properties - replacing any already listed
+    g_list_free_full (devs, free_device);
+    devs = NULL;
+    info = XIQueryDevice (dpy, XIAllDevices, &ndevs);
+    for (i = 0; i < ndevs; i++)
+    {
+        dev = probe_device (&info[i]);
+        if (!dev) continue;
+
+        if (dev->has_speed) speed = dev->speed;
+        if (dev->has_left_handed) cur_left_handed = dev->left_handed != swapped;
+        devs = g_list_append (devs, dev);
+    }
+    XIFreeDeviceInfo (info);
+
+    trace_end ("read xinput devices", span);
+}
 
-    // query xinput for list of slave pointer devices - returned as ids, one per line
-    fp_dev = popen ("xinput list | grep pointer | grep slave | cut -f 2 | cut -d = -f 2", "r");
-    if (fp_dev)
+static gboolean kf_cache_current (void)
+{
+    if (!kf_cache.user || !kf_cache.valid) return FALSE;
+
+    return stamp_current (kf_cache.file, &kf_cache.stamp) && stamp_current (kf_cache.sys_file, &kf_cache.sys_stamp);
+}
+
+static void kf_cache_load (void)
+{
+    gint64 span;
+
+    const char *session_name = g_getenv ("DESKTOP_SESSION");
+    if (!session_name) session_name = DEFAULT_SES;
+
+    if (!kf_cache.file)
+    {
+        kf_cache.file = g_build_filename (g_get_user_config_dir(), "lxsession", session_name, "desktop.conf", NULL);
+        kf_cache.sys_file = g_build_filename ("/etc", "xdg", "lxsession", session_name, "desktop.conf", NULL);
+    }
+
+    // discard any stale copy - what is on disk is not known until it is first committed over
+    if (kf_cache.user) g_key_file_free (kf_cache.user);
+    if (kf_cache.sys) g_key_file_free (kf_cache.sys);
+    kf_cache.hash.valid = FALSE;
+
+    span = trace_begin ();
+    kf_cache.sys = g_key_file_new ();
+    if (stamp_file (kf_cache.sys_file, &kf_cache.sys_stamp)) g_key_file_load_from_file (kf_cache.sys, kf_cache.sys_file,
+        G_KEY_FILE_KEEP_COMMENTS | G_KEY_FILE_KEEP_TRANSLATIONS, NULL);
+
+    // edits go into the user file, which starts as a copy of the global one if there is none yet
+    kf_cache.user = g_key_file_new ();
+    kf_cache.exists = stamp_file (kf_cache.file, &kf_cache.stamp);
+    if (!kf_cache.exists || !g_key_file_load_from_file (kf_cache.user, kf_cache.file,
+        G_KEY_FILE_KEEP_COMMENTS | G_KEY_FILE_KEEP_TRANSLATIONS, NULL))
+    {
+        kf_cache.exists = FALSE;
+        if (kf_cache.sys_stamp.exists) g_key_file_load_from_file (kf_cache.user, kf_cache.sys_file,
+            G_KEY_FILE_KEEP_COMMENTS | G_KEY_FILE_KEEP_TRANSLATIONS, NULL);
+    }
+    trace_end ("read desktop.conf", span);
+
+    kf_cache.loads++;
+    kf_cache.valid = TRUE;
+}
+
+static void kf_cache_free (void)
+{
+    g_mutex_lock (&kf_cache.lock);
+    if (kf_cache.user) g_key_file_free (kf_cache.user);
+    if (kf_cache.sys) g_key_file_free (kf_cache.sys);
+    kf_cache.user = kf_cache.sys = NULL;
+    kf_cache.valid = FALSE;
+    g_mutex_unlock (&kf_cache.lock);
+}
+
+static void begin_kf_edit (void)
+{
+    // held until commit_kf_edit, as set_many can run on the apply thread while the main loop reads
+    g_mutex_lock (&kf_cache.lock);
+
+    // desktop.conf is parsed again only when the user or global file has been touched
+    if (!kf_cache_current ()) kf_cache_load ();
+
+    // with no user file yet, it must be written even if it would match the global one
+    kf_cache.dirty = !kf_cache.exists;
+}
+
+static void set_kf_value (const char *section, const char *item, const char *val)
+{
+    char *str;
+
+    // stage the edit in the cached key file - caller must have begun an edit
+    str = g_key_file_get_value (kf_cache.user, section, item, NULL);
+    if (g_strcmp0 (str, val))
+    {
+        g_key_file_set_value (kf_cache.user, section, item, val);
+        kf_cache.dirty = TRUE;
+    }
+    g_free (str);
+}
+
+static gboolean commit_kf_edit (void)
+{
+    char *str;
+    gsize len;
+    gint64 span;
+    int res;
+    gboolean changed = FALSE;
+
+    // write out all staged edits at once - if any of them changed anything
+    if (kf_cache.dirty)
     {
-        // loop through devices
-        while (fgets (dev, sizeof (dev) - 1, fp_dev))
+        if (!kf_cache.exists)
         {
-            g_strstrip (dev);
-
-            // query xinput for acceleration value for each device
-            cmd = g_strdup_printf ("xinput list-props %s | grep \"Accel Speed\" | head -n 1 | cut -f 3", dev);
-            fp_acc = popen (cmd, "r");
-            if (fp_acc)
-            {
-                if (fgets (acc, sizeof (acc) - 1, fp_acc))
-                {
-                    if (sscanf (acc, "%f", &fval) == 1)
-                    {
-                        speed = fval;
-                        devs = g_list_append (devs, g_strdup (dev));
-                    }
-                }
-                pclose (fp_acc);
-            }
-            g_free (cmd);
+            // no user config - create the local config directory
+            str = g_path_get_dirname (kf_cache.file);
+            g_mkdir_with_parents (str, 0700);
+            g_free (str);
         }
-        pclose (fp_dev);
+
+        span = trace_begin ();
+        str = g_key_file_to_data (kf_cache.user, &len, NULL);
+        res = commit_file (kf_cache.file, str, len, &kf_cache.hash);
+        if (res < 0) kf_cache.valid = FALSE;
+        else if (res > 0)
+        {
+            kf_cache.exists = stamp_file (kf_cache.file, &kf_cache.stamp);
+            changed = TRUE;
+        }
+        g_free (str);
+        trace_end ("write desktop.conf", span);
+
+        kf_cache.dirty = FALSE;
     }
+    g_mutex_unlock (&kf_cache.lock);
 
-    setlocale (LC_NUMERIC, oldloc);
+    return changed;
 }
 
 static int read_key_file_int (GKeyFile *user, GKeyFile *sys, const char *section, const char *item, int fallback)
@@ -126,66 +626,57 @@ static int read_key_file_int (GKeyFile *user, GKeyFile *sys, const char *section
 
 static void read_lxsession (void)
 {
-    GKeyFile *kfu, *kfs;
-    char *config_file;
-
-    const char *session_name = g_getenv ("DESKTOP_SESSION");
-    if (!session_name) session_name = DEFAULT_SES;
+    // the key files stay loaded, so later edits need not parse them again
+    g_mutex_lock (&kf_cache.lock);
+    if (!kf_cache_current ()) kf_cache_load ();
+
+    delay = read_key_file_int (kf_cache.user, kf_cache.sys, "Keyboard", "Delay", DEFAULT_KB_DELAY);
+    interval = read_key_file_int (kf_cache.user, kf_cache.sys, "Keyboard", "Interval", DEFAULT_KB_INTERVAL);
+    dclick = read_key_file_int (kf_cache.user, kf_cache.sys, "GTK", "iNet/DoubleClickTime", DEFAULT_MOUSE_DCLICK);
+    left_handed = read_key_file_int (kf_cache.user, kf_cache.sys, "Mouse", "LeftHanded", 0);
+    read_loads = kf_cache.loads;
+    g_mutex_unlock (&kf_cache.lock);
+}
 
-    kfu = g_key_file_new ();
-    config_file = g_build_filename (g_get_user_config_dir(), "lxsession", session_name, "desktop.conf", NULL);
-    g_key_file_load_from_file (kfu, config_file, G_KEY_FILE_NONE, NULL);
-    g_free (config_file);
+static gboolean read_stored_speed (float *val)
+{
+    char *str = NULL;
 
-    kfs = g_key_file_new ();
-    config_file = g_build_filename ("/etc", "xdg", "lxsession", session_name, "desktop.conf", NULL);
-    g_key_file_load_from_file (kfs, config_file, G_KEY_FILE_NONE, NULL);
-    g_free (config_file);
+    g_mutex_lock (&kf_cache.lock);
+    if (!kf_cache_current ()) kf_cache_load ();
 
-    delay = read_key_file_int (kfu, kfs, "Keyboard", "Delay", DEFAULT_KB_DELAY);
-    interval = read_key_file_int (kfu, kfs, "Keyboard", "Interval", DEFAULT_KB_INTERVAL);
-    dclick = read_key_file_int (kfu, kfs, "GTK", "iNet/DoubleClickTime", DEFAULT_MOUSE_DCLICK);
-    left_handed = read_key_file_int (kfu, kfs, "Mouse", "LeftHanded", 0);
+    // the pointer speed is only ever stored in the user config
+    if (kf_cache.exists) str = g_key_file_get_value (kf_cache.user, "Mouse", "AccelSpeed", NULL);
+    g_mutex_unlock (&kf_cache.lock);
 
-    g_key_file_free (kfu);
-    g_key_file_free (kfs);
+    if (!str) return FALSE;
+    *val = g_ascii_strtod (str, NULL);
+    g_free (str);
+    return TRUE;
 }
 
-static void write_lxsession (const char *section, const char *param, int value)
+static void write_autostart (void)
 {
-    char *config_file, *sysconf_file, *str;
-    GKeyFile *kf;
-    gsize len;
-
-    const char *session_name = g_getenv ("DESKTOP_SESSION");
-    if (!session_name) session_name = DEFAULT_SES;
-
-    // try to open the user config file
-    kf = g_key_file_new ();
-    config_file = g_build_filename (g_get_user_config_dir(), "lxsession", session_name, "desktop.conf", NULL);
-    if (!g_key_file_load_from_file (kf, config_file, G_KEY_FILE_KEEP_COMMENTS | G_KEY_FILE_KEEP_TRANSLATIONS, NULL))
-    {
-        // no user config - create the local config directory
-        str = g_path_get_dirname (config_file);
-        g_mkdir_with_parents (str, 0700);
-        g_free (str);
+    char *config_file, *dir, *str;
 
-        // load the global config
-        sysconf_file = g_build_filename ("/etc", "xdg", "lxsession", session_name, "desktop.conf", NULL);
-        g_key_file_load_from_file (kf, sysconf_file, G_KEY_FILE_KEEP_COMMENTS | G_KEY_FILE_KEEP_TRANSLATIONS, NULL);
-        g_free (sysconf_file);
-    }
+    // clean up old autostart
+    config_file = g_build_filename (g_get_user_config_dir(), "autostart", "LXinput-setup.desktop", NULL);
+    if (g_file_test (config_file, G_FILE_TEST_IS_REGULAR)) remove (config_file);
+    g_free (config_file);
 
-    // update value in the key file
-    g_key_file_set_integer (kf, section, param, value);
+    // save pointer acceleration into autostart
+    config_file = g_build_filename (g_get_user_config_dir(), "autostart", "set-mouse-speed.desktop", NULL);
+    dir = g_path_get_dirname (config_file);
+    g_mkdir_with_parents (dir, 0755);
+    g_free (dir);
 
-    // write the modified key file out
-    str = g_key_file_to_data (kf, &len, NULL);
-    g_file_set_contents (config_file, str, len, NULL);
+    // the service is always installed, and its headless apply mode reads the speed back from desktop.conf
+    str = g_strdup ("[Desktop Entry]\nType=Application\nName=set-mouse-speed\nComment=Set mouse speed\nNoDisplay=true\n"
+        "Exec=" LIBEXECDIR "/rasputin-service --apply\n");
+    commit_file (config_file, str, strlen (str), NULL);
+    g_free (str);
 
     g_free (config_file);
-    g_free (str);
-    g_key_file_free (kf);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -194,60 +685,174 @@ static void write_lxsession (const char *section, const char *param, int value)
 
 static void load_config (void)
 {
-    read_speed ();
+    g_mutex_lock (&xi_lock);
+
+    // once the hotplug watch is running it keeps the device list current, so it is only queried the first time
+    if (xi_watch) speed = cur_speed;
+    else
+    {
+        read_speed ();
+        cur_speed = speed;
+    }
     read_lxsession ();
+    watch_devices ();
+    g_mutex_unlock (&xi_lock);
 }
 
-static void set_doubleclick (void)
+static gboolean config_current (void)
 {
-    write_lxsession ("GTK", "iNet/DoubleClickTime", dclick);
+    gboolean res;
+
+    // the devices are kept current by the hotplug watch - desktop.conf must not have been read again since the values were
+    g_mutex_lock (&kf_cache.lock);
+    res = kf_cache_current () && kf_cache.loads == read_loads;
+    g_mutex_unlock (&kf_cache.lock);
+
+    return res && xi_watch;
 }
 
-static void set_speed (void)
+static void free_config (void)
 {
-    char *cmd, *config_file, *dir, *str;
-    char *oldloc = setlocale (LC_NUMERIC, NULL);
-    GList *dev;
+    g_mutex_lock (&xi_lock);
+    if (xi_watch) g_source_remove (xi_watch);
+    xi_watch = 0;
 
-    setlocale (LC_NUMERIC, "POSIX");
+    g_list_free_full (devs, free_device);
+    devs = NULL;
 
-    for (dev = devs; dev != NULL; dev = dev->next)
+    // put back the handler replaced in xi_open, so a later open does not chain to itself
+    if (dpy)
     {
-        cmd = g_strdup_printf ("xinput set-prop %s \"libinput Accel Speed\" %f", (char *) dev->data, speed);
-        system (cmd);
-        g_free (cmd);
+        XSetErrorHandler (old_handler);
+        old_handler = NULL;
+        XCloseDisplay (dpy);
     }
+    dpy = NULL;
+    g_mutex_unlock (&xi_lock);
 
-    // clean up old autostart
-    config_file = g_build_filename (g_get_user_config_dir(), "autostart", "LXinput-setup.desktop", NULL);
-    if (g_file_test (config_file, G_FILE_TEST_IS_REGULAR)) remove (config_file);
-    g_free (config_file);
+    kf_cache_free ();
+    free_snapshot (&lxsession_snapshot);
+    free_snapshot (&autostart_snapshot);
+    free_snapshot (&legacy_snapshot);
+}
 
-    // save pointer acceleration into autostart
-    config_file = g_build_filename (g_get_user_config_dir(), "autostart", "set-mouse-speed.desktop", NULL);
-    dir = g_path_get_dirname (config_file);
-    g_mkdir_with_parents (dir, 0755);
-    g_free (dir);
+static void apply_config (void)
+{
+    float fval;
 
-    str = g_strdup_printf ("[Desktop Entry]\nType=Application\nName=set-mouse-speed\nComment=Set mouse speed\nNoDisplay=true\n"
-        "Exec=sh -c 'if pgrep openbox ; then for id in $(xinput list | grep pointer | grep slave | cut -f 2 | cut -d = -f 2) ; do xinput set-prop $id \"libinput Accel Speed\" %f ; done ; fi'\n", speed);
-    g_file_set_contents (config_file, str, -1, NULL);
-    g_free (str);
+    // lxsession applies the handedness and keyboard settings itself at login - only the pointer speed is ours
+    if (!read_stored_speed (&fval)) return;
 
-    g_free (config_file);
+    g_mutex_lock (&xi_lock);
+    if (!dpy) read_speed ();
+    g_mutex_unlock (&xi_lock);
 
-    setlocale (LC_NUMERIC, oldloc);
+    speed = fval;
+    write_devices (TRUE, FALSE);
+}
+
+static void set_doubleclick (void)
+{
+    set_many (KM_MASK (KM_DCLICK));
+}
+
+static void set_speed (void)
+{
+    set_many (KM_MASK (KM_SPEED));
 }
 
 static void set_keyboard (void)
 {
-    write_lxsession ("Keyboard", "Delay", delay);
-    write_lxsession ("Keyboard", "Interval", interval);
+    set_many (KM_MASK (KM_KEYBOARD));
 }
 
 static void set_lefthanded (void)
 {
-    write_lxsession ("Mouse", "LeftHanded", left_handed);
+    set_many (KM_MASK (KM_LEFTHANDED));
+}
+
+static void set_many (guint settings)
+{
+    char buf[16], sbuf[G_ASCII_DTOSTR_BUF_SIZE];
+
+    // both device properties go to the X server in one round trip
+    if (settings & (KM_MASK (KM_SPEED) | KM_MASK (KM_LEFTHANDED)))
+        write_devices ((settings & KM_MASK (KM_SPEED)) != 0, (settings & KM_MASK (KM_LEFTHANDED)) != 0);
+    if (settings & KM_MASK (KM_KEYBOARD)) write_repeat (delay, interval);
+
+    // and every stored value goes into desktop.conf in one commit - the speed so it can be applied again at login
+    begin_kf_edit ();
+    if (settings & KM_MASK (KM_DCLICK))
+    {
+        g_snprintf (buf, sizeof (buf), "%d", dclick);
+        set_kf_value ("GTK", "iNet/DoubleClickTime", buf);
+    }
+    if (settings & KM_MASK (KM_SPEED))
+    {
+        g_ascii_formatd (sbuf, sizeof (sbuf), "%f", speed);
+        set_kf_value ("Mouse", "AccelSpeed", sbuf);
+    }
+    if (settings & KM_MASK (KM_KEYBOARD))
+    {
+        g_snprintf (buf, sizeof (buf), "%d", delay);
+        set_kf_value ("Keyboard", "Delay", buf);
+        g_snprintf (buf, sizeof (buf), "%d", interval);
+        set_kf_value ("Keyboard", "Interval", buf);
+    }
+    if (settings & KM_MASK (KM_LEFTHANDED))
+    {
+        g_snprintf (buf, sizeof (buf), "%d", left_handed);
+        set_kf_value ("Mouse", "LeftHanded", buf);
+    }
+    if (commit_kf_edit () && (settings & KM_MASK (KM_DCLICK))) reload_xsettings ();
+
+    if (settings & KM_MASK (KM_SPEED)) write_autostart ();
+}
+
+static void snapshot (void)
+{
+    char *path;
+
+    const char *session_name = g_getenv ("DESKTOP_SESSION");
+    if (!session_name) session_name = DEFAULT_SES;
+
+    path = g_build_filename (g_get_user_config_dir(), "lxsession", session_name, "desktop.conf", NULL);
+    snapshot_file (&lxsession_snapshot, path);
+    g_free (path);
+
+    path = g_build_filename (g_get_user_config_dir(), "autostart", "set-mouse-speed.desktop", NULL);
+    snapshot_file (&autostart_snapshot, path);
+    g_free (path);
+
+    path = g_build_filename (g_get_user_config_dir(), "autostart", "LXinput-setup.desktop", NULL);
+    snapshot_file (&legacy_snapshot, path);
+    g_free (path);
+
+    g_mutex_lock (&xi_lock);
+    speed_snapshot = cur_speed;
+    left_handed_snapshot = cur_left_handed;
+    repeat_snapshot = dpy && XkbGetAutoRepeatRate (dpy, XkbUseCoreKbd, &delay_snapshot, &interval_snapshot);
+    g_mutex_unlock (&xi_lock);
+}
+
+static void restore (void)
+{
+    int res;
+
+    // each file is put back in one write, or not at all if it is unchanged - the cache is re-read before any later edit
+    g_mutex_lock (&kf_cache.lock);
+    res = restore_file (&lxsession_snapshot);
+    if (res) kf_cache.valid = FALSE;
+    g_mutex_unlock (&kf_cache.lock);
+    if (res > 0) reload_xsettings ();
+    restore_file (&autostart_snapshot);
+    restore_file (&legacy_snapshot);
+
+    // and the devices get back whichever original properties were changed, in one round trip
+    speed = speed_snapshot;
+    left_handed = left_handed_snapshot;
+    write_devices (speed != cur_speed, left_handed != cur_left_handed);
+    if (repeat_snapshot) write_repeat (delay_snapshot, interval_snapshot);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -256,10 +861,16 @@ static void set_lefthanded (void)
 
 km_functions_t openbox_ifunctions = {
     .load_config = load_config,
+    .config_current = config_current,
+    .free_config = free_config,
+    .apply_config = apply_config,
     .set_doubleclick = set_doubleclick,
     .set_speed = set_speed,
     .set_keyboard = set_keyboard,
     .set_lefthanded = set_lefthanded,
+    .set_many = set_many,
+    .snapshot = snapshot,
+    .restore = restore,
 };
 
 /* End of file */
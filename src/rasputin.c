@@ -28,12 +28,15 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 ============================================================================*/
 
 #include <locale.h>
+#include <stdarg.h>
+#include <math.h>
 #include <gtk/gtk.h>
 #include <glib/gi18n.h>
 #include "rasputin.h"
 
 extern km_functions_t labwc_ifunctions;
 extern km_functions_t openbox_ifunctions;
+extern km_functions_t client_ifunctions;
 
 #ifdef PLUGIN_NAME
 extern void call_plugin_func (char *name);
@@ -43,7 +46,43 @@ extern void call_plugin_func (char *name);
 /* Typedefs and macros */
 /*----------------------------------------------------------------------------*/
 
-#define TIMEOUT_MS 500
+/* Most commits per second while a control is being moved */
+#define MAX_APPLY_RATE 10
+
+/* Location of the compiled-in UI definitions */
+#define UI_PATH "/com/raspberrypi/rasputin/ui/"
+
+/* Key file group holding the values in an input profile */
+#define PROFILE_GROUP "Input Profile"
+
+/* Leave the backend idle for at least this many times as long as a commit takes */
+#define APPLY_BACKOFF 2
+
+/* Double-click analyser - number of gaps kept, histogram bin width and longest gap counted, in ms */
+#define DCLICK_SAMPLES 64
+#define DCLICK_BIN 100
+#define DCLICK_MAX 2000
+#define DCLICK_BINS (DCLICK_MAX / DCLICK_BIN)
+
+/* Presses with no gap longer than the slowest double-click the slider allows belong to one burst -
+   only a burst of exactly two is a double-click */
+#define DCLICK_QUIET DCLICK_MAX
+
+/* Gaps needed before a delay is suggested, and the share of them it must cover */
+#define DCLICK_MIN_SAMPLES 5
+#define DCLICK_PERCENTILE 95
+
+/* Measured key repeat timings further than this percentage, plus 2 ms, from the settings are flagged */
+#define REPEAT_TOLERANCE 15
+
+/* Timings of the key currently held in the keyboard test entry */
+typedef struct {
+    guint16 keycode;
+    gint64 press, last;
+    int repeats;
+    double first_delay;
+    double sum, sum_sq;
+} repeat_run_t;
 
 /*----------------------------------------------------------------------------*/
 /* Global data */
@@ -53,70 +92,174 @@ extern void call_plugin_func (char *name);
 static GtkWidget *mouse_speed, *mouse_dclick, *mouse_left_handed,
     *kb_delay, *kb_interval, *kb_layout, *dclick_btn, *dclick_ind;
 
-/* Setting values */
+/* Setting values - read and written by the backend, only from the apply thread once it is running */
 int dclick, delay, interval;
 float speed;
 gboolean left_handed;
 
-#ifndef PLUGIN_NAME
-/* Setting backups */
-static int old_dclick, old_delay, old_interval;
-static float old_speed;
-static gboolean old_left_handed;
-#endif
+/* Values shown in the UI */
+static km_values_t vals;
+
+/* Values most recently passed to the apply queue */
+static km_values_t sent_vals;
+
+/* Values when the panel was opened - the backend keeps a snapshot of its files to match */
+static km_values_t old_vals;
 
-/* Control timer handles */
-static guint dctimer, matimer, kbtimer;
+/* Settings changed since the last commit, and the timer which will commit them */
+static guint dirty, commit_timer;
+
+/* Start time and smoothed duration of recent commits */
+static gint64 last_commit, commit_cost;
 
 static km_functions_t km_fn;
 
-static GtkBuilder *builder;
+/* Builders for each tab, and size groups shared between them */
+static GtkBuilder *tab_builder[2];
+static GtkSizeGroup *row_group, *unit_group, *label_group;
+
 static GtkGesture *gesture;
 static GdkPixbuf *black, *white;
 
+/* Double-click analyser - a ring of the most recent gaps between the two clicks of a double-click */
+static GtkWidget *dclick_hist, *dclick_stats, *dclick_use;
+static guint dclick_gaps[DCLICK_SAMPLES];
+static int n_gaps, next_gap, n_rejected, suggested;
+static guint32 last_click, pair_gap;
+static int burst_clicks;
+static guint burst_timer;
+
+/* Key repeat analyser */
+static GtkWidget *kbd_stats;
+static repeat_run_t repeat_run;
+
 /*----------------------------------------------------------------------------*/
 /* Function prototypes */
 /*----------------------------------------------------------------------------*/
 
-static gboolean dclick_handler (gpointer data);
-static gboolean speed_handler (gpointer data);
-static gboolean kbd_handler (gpointer data);
+static gboolean is_sent (km_setting_t setting);
+static void mark_dirty (km_setting_t setting);
+static void schedule_commit (void);
+static void commit_now (void);
+static void on_applied (guint settings, gint64 usecs, gpointer data);
+static gboolean commit_handler (gpointer data);
 static void init_config (void);
-static gboolean on_mouse_dclick_changed (GtkRange *range, GdkEventButton *event, gpointer user_data);
-static gboolean on_mouse_speed_changed (GtkRange *range, GdkEventButton *event, gpointer user_data);
-static gboolean on_kb_range_changed (GtkRange *range, GdkEventButton *event, int *val);
+static void revert_config (void);
+#ifdef PLUGIN_NAME
+static void update_widgets (void);
+#endif
+static void group_widgets (GtkSizeGroup *group, GtkBuilder *bld, ...);
+static void init_mouse_page (GtkBuilder *bld);
+static void init_kbd_page (GtkBuilder *bld);
+static GtkBuilder *load_ui (const char *name);
+static GtkWidget *build_tab (int tab);
+static void free_ui (void);
+static void show_dclick_time (int time);
+static void on_mouse_dclick_changed (GtkRange *range, gpointer user_data);
+static void on_mouse_speed_changed (GtkRange *range, gpointer user_data);
+static void on_kb_range_changed (GtkRange *range, int *val);
+static gboolean on_range_done (GtkWidget *widget, GdkEvent *event, gpointer data);
 static void on_left_handed_toggle (GtkSwitch *btn, gpointer, gpointer user_data);
 static void on_set_keyboard_ext (GtkButton *btn, gpointer ptr);
 static gboolean reset_indicator (gpointer ptr);
+static gboolean reset_gesture (gpointer ptr);
 static void on_gpress (GtkGestureMultiPress *self, gint n_press, gdouble x, gdouble y, gpointer ptr);
+static int compare_gaps (const void *a, const void *b);
+static void end_burst (void);
+static gboolean burst_done (gpointer data);
+static void record_click (guint32 time);
+static void show_dclick_stats (const char *text);
+static void update_dclick_stats (void);
+static gboolean on_hist_draw (GtkWidget *widget, cairo_t *cr, gpointer data);
+static void on_dclick_use (GtkButton *btn, gpointer ptr);
+static gboolean repeat_matches (double measured, int set);
+static void update_repeat_stats (void);
+static gboolean on_kbd_key_press (GtkWidget *widget, GdkEventKey *event, gpointer data);
+static gboolean on_kbd_key_release (GtkWidget *widget, GdkEventKey *event, gpointer data);
 #ifndef PLUGIN_NAME
 static gboolean ok_main (GtkButton *button, gpointer data);
 static gboolean cancel_main (GtkButton *button, gpointer data);
 static gboolean close_prog (GtkWidget *widget, GdkEvent *event, gpointer data);
+static guint cli_parse (const char *name, const char *str, km_values_t *v);
+static gboolean cli_format (GString *out, const char *name);
+static gboolean cli_value (const char *name, const char *str, km_values_t *v, guint *mask);
+static int run_cli (int argc, char *argv[]);
 #endif
 
 /*----------------------------------------------------------------------------*/
-/* Timer handlers */
+/* Batched commits */
 /*----------------------------------------------------------------------------*/
 
-static gboolean dclick_handler (gpointer data)
+static gboolean is_sent (km_setting_t setting)
 {
-    km_fn.set_doubleclick ();
-    dctimer = 0;
-    return FALSE;
+    switch (setting)
+    {
+        case KM_DCLICK :        return vals.dclick == sent_vals.dclick;
+        case KM_SPEED :         return vals.speed == sent_vals.speed;
+        case KM_KEYBOARD :      return vals.delay == sent_vals.delay && vals.interval == sent_vals.interval;
+        case KM_LEFTHANDED :    return vals.left_handed == sent_vals.left_handed;
+        default :               return FALSE;
+    }
 }
 
-static gboolean speed_handler (gpointer data)
+static void mark_dirty (km_setting_t setting)
 {
-    km_fn.set_speed ();
-    matimer = 0;
-    return FALSE;
+    dirty |= KM_MASK (setting);
+    schedule_commit ();
+}
+
+static void schedule_commit (void)
+{
+    gint64 now, due;
+
+    /* the pending commit will pick up everything marked dirty before it fires */
+    if (commit_timer) return;
+
+    /* collect changes for one rate limit window, and leave the backend time to keep up */
+    now = g_get_monotonic_time ();
+    due = MAX (now + G_USEC_PER_SEC / MAX_APPLY_RATE, last_commit + commit_cost * APPLY_BACKOFF);
+
+    commit_timer = g_timeout_add ((due - now) / 1000 + 1, commit_handler, NULL);
+}
+
+static void commit_now (void)
+{
+    guint settings = 0;
+    int i;
+
+    if (commit_timer) g_source_remove (commit_timer);
+    commit_timer = 0;
+
+    /* a control moved away and back again needs nothing sent */
+    for (i = 0; i < KM_N_SETTINGS; i++)
+        if ((dirty & KM_MASK (i)) && !is_sent (i)) settings |= KM_MASK (i);
+    dirty = 0;
+    if (!settings) return;
+
+    if (settings & KM_MASK (KM_DCLICK)) sent_vals.dclick = vals.dclick;
+    if (settings & KM_MASK (KM_SPEED)) sent_vals.speed = vals.speed;
+    if (settings & KM_MASK (KM_KEYBOARD))
+    {
+        sent_vals.delay = vals.delay;
+        sent_vals.interval = vals.interval;
+    }
+    if (settings & KM_MASK (KM_LEFTHANDED)) sent_vals.left_handed = vals.left_handed;
+
+    last_commit = g_get_monotonic_time ();
+    apply_settings (settings, &vals);
+}
+
+static void on_applied (guint settings, gint64 usecs, gpointer data)
+{
+    /* keep a smoothed measure of how long the backend takes for a batch */
+    if (commit_cost) commit_cost = (commit_cost * 3 + usecs) / 4;
+    else commit_cost = usecs;
 }
 
-static gboolean kbd_handler (gpointer data)
+static gboolean commit_handler (gpointer data)
 {
-    km_fn.set_keyboard ();
-    kbtimer = 0;
+    commit_timer = 0;
+    commit_now ();
     return FALSE;
 }
 
@@ -124,34 +267,43 @@ static gboolean kbd_handler (gpointer data)
 /* Widget handlers */
 /*----------------------------------------------------------------------------*/
 
-static gboolean on_mouse_dclick_changed (GtkRange *range, GdkEventButton *event, gpointer user_data)
+static void show_dclick_time (int time)
 {
-    if (dctimer) g_source_remove (dctimer);
-    dclick = gtk_range_get_value (range);
-    dctimer = g_timeout_add (TIMEOUT_MS, dclick_handler, NULL);
-    return FALSE;
+    /* the test area reads the threshold from this process's settings, so it follows the slider without waiting for the backend */
+    g_object_set (gtk_settings_get_default (), "gtk-double-click-time", time, NULL);
 }
 
-static gboolean on_mouse_speed_changed (GtkRange *range, GdkEventButton *event, gpointer user_data)
+static void on_mouse_dclick_changed (GtkRange *range, gpointer user_data)
 {
-    if (matimer) g_source_remove (matimer);
-    speed = (gtk_range_get_value (range) / 5.0) - 1.0;
-    matimer = g_timeout_add (TIMEOUT_MS, speed_handler, NULL);
-    return FALSE;
+    vals.dclick = gtk_range_get_value (range);
+    show_dclick_time (vals.dclick);
+    update_dclick_stats ();
+    mark_dirty (KM_DCLICK);
+}
+
+static void on_mouse_speed_changed (GtkRange *range, gpointer user_data)
+{
+    vals.speed = (gtk_range_get_value (range) / 5.0) - 1.0;
+    mark_dirty (KM_SPEED);
 }
 
-static gboolean on_kb_range_changed (GtkRange *range, GdkEventButton *event, int *val)
+static void on_kb_range_changed (GtkRange *range, int *val)
 {
-    if (kbtimer) g_source_remove (kbtimer);
     *val = (int) gtk_range_get_value (range);
-    kbtimer = g_timeout_add (TIMEOUT_MS, kbd_handler, NULL);
+    mark_dirty (KM_KEYBOARD);
+}
+
+static gboolean on_range_done (GtkWidget *widget, GdkEvent *event, gpointer data)
+{
+    /* everything changed so far is committed straight away once a control is let go of */
+    commit_now ();
     return FALSE;
 }
 
 static void on_left_handed_toggle (GtkSwitch *btn, gpointer, gpointer user_data)
 {
-    left_handed = gtk_switch_get_active (btn);
-    km_fn.set_lefthanded ();
+    vals.left_handed = gtk_switch_get_active (btn);
+    mark_dirty (KM_LEFTHANDED);
 }
 
 static void on_set_keyboard_ext (GtkButton *btn, gpointer ptr)
@@ -160,6 +312,7 @@ static void on_set_keyboard_ext (GtkButton *btn, gpointer ptr)
     call_plugin_func ("on_set_keyboard");
 #else
     g_spawn_command_line_async ("rc_gui -k", NULL);
+    trace_count (TRACE_PROCESSES, 1);
 #endif
 }
 
@@ -169,65 +322,485 @@ static gboolean reset_indicator (gpointer ptr)
     return FALSE;
 }
 
+static gboolean reset_gesture (gpointer ptr)
+{
+    if (gesture) gtk_event_controller_reset (GTK_EVENT_CONTROLLER (gesture));
+    return FALSE;
+}
+
 static void on_gpress (GtkGestureMultiPress *self, gint n_press, gdouble x, gdouble y, gpointer ptr)
 {
+    GdkEventSequence *seq = gtk_gesture_single_get_current_sequence (GTK_GESTURE_SINGLE (self));
+    const GdkEvent *ev = gtk_gesture_get_last_event (GTK_GESTURE (self), seq);
+
+    /* time every press, whatever GTK made of it - its count depends on the delay being measured */
+    if (ev) record_click (gdk_event_get_time (ev));
+
     if (n_press == 2)
     {
-        g_object_unref (gesture);
-        gesture = gtk_gesture_multi_press_new (dclick_btn);
-        g_signal_connect (gesture, "pressed", G_CALLBACK (on_gpress), NULL);
+        /* count from one again on the next press, once this event has been handled */
+        g_idle_add (reset_gesture, NULL);
         gtk_image_set_from_pixbuf (GTK_IMAGE (dclick_ind), white);
         g_timeout_add (250, G_SOURCE_FUNC (reset_indicator), NULL);
     }
 }
 
+/*----------------------------------------------------------------------------*/
+/* Double-click analyser                                                      */
+/*----------------------------------------------------------------------------*/
+
+static int compare_gaps (const void *a, const void *b)
+{
+    guint ga = *((const guint *) a), gb = *((const guint *) b);
+
+    return ga < gb ? -1 : ga > gb;
+}
+
+static void end_burst (void)
+{
+    if (burst_timer) g_source_remove (burst_timer);
+    burst_timer = 0;
+
+    /* a single stray press, or a triple-click, says nothing about the double-click gap */
+    if (burst_clicks == 2 && pair_gap <= DCLICK_MAX)
+    {
+        dclick_gaps[next_gap] = pair_gap;
+        next_gap = (next_gap + 1) % DCLICK_SAMPLES;
+        if (n_gaps < DCLICK_SAMPLES) n_gaps++;
+        update_dclick_stats ();
+    }
+    else if (burst_clicks > 2)
+    {
+        /* say so, rather than silently ignoring clicks made too close together */
+        n_rejected++;
+        update_dclick_stats ();
+    }
+    burst_clicks = 0;
+}
+
+static gboolean burst_done (gpointer data)
+{
+    burst_timer = 0;
+    end_burst ();
+    return FALSE;
+}
+
+static void record_click (guint32 time)
+{
+    /* a press after a quiet spell starts a new burst, even if the timer has not yet fired */
+    if (burst_clicks && time - last_click > DCLICK_QUIET) end_burst ();
+
+    if (burst_clicks == 1) pair_gap = time - last_click;
+    burst_clicks++;
+    last_click = time;
+
+    /* the burst is only judged once it is over - a third press inside it means it was not a double-click */
+    if (burst_timer) g_source_remove (burst_timer);
+    burst_timer = g_timeout_add (DCLICK_QUIET, burst_done, NULL);
+}
+
+static void show_dclick_stats (const char *text)
+{
+    char *str;
+
+    /* clicks in a burst of three or more are not counted, so say how many bursts there have been */
+    if (n_rejected)
+    {
+        str = g_strdup_printf (_("%s\n%d bursts of more than two clicks ignored - pause after each double-click"), text, n_rejected);
+        gtk_label_set_text (GTK_LABEL (dclick_stats), str);
+        g_free (str);
+    }
+    else gtk_label_set_text (GTK_LABEL (dclick_stats), text);
+}
+
+static void update_dclick_stats (void)
+{
+    GtkAdjustment *adj;
+    guint sorted[DCLICK_SAMPLES];
+    int median, pc;
+    char *str;
+
+    if (!dclick_stats) return;
+
+    if (n_gaps < DCLICK_MIN_SAMPLES)
+    {
+        str = g_strdup_printf (_("Double-click the square %d more times, pausing between each, to suggest a delay"), DCLICK_MIN_SAMPLES - n_gaps);
+        show_dclick_stats (str);
+        g_free (str);
+        gtk_widget_set_sensitive (dclick_use, FALSE);
+        suggested = 0;
+        gtk_widget_queue_draw (dclick_hist);
+        return;
+    }
+
+    /* nearest rank percentiles over the gaps kept */
+    memcpy (sorted, dclick_gaps, n_gaps * sizeof (guint));
+    qsort (sorted, n_gaps, sizeof (guint), compare_gaps);
+    median = sorted[(n_gaps - 1) / 2];
+    pc = sorted[(n_gaps * DCLICK_PERCENTILE + 99) / 100 - 1];
+
+    /* suggest the next step of the delay slider at or above the percentile */
+    adj = gtk_range_get_adjustment (GTK_RANGE (mouse_dclick));
+    suggested = (pc + DCLICK_BIN - 1) / DCLICK_BIN * DCLICK_BIN;
+    suggested = CLAMP (suggested, gtk_adjustment_get_lower (adj), gtk_adjustment_get_upper (adj));
+
+    str = g_strdup_printf (_("%d double-clicks: median %d ms, %d%% within %d ms"), n_gaps, median, DCLICK_PERCENTILE, pc);
+    show_dclick_stats (str);
+    g_free (str);
+
+    str = g_strdup_printf (_("Use %d ms"), suggested);
+    gtk_button_set_label (GTK_BUTTON (dclick_use), str);
+    g_free (str);
+    gtk_widget_set_sensitive (dclick_use, suggested != vals.dclick);
+
+    gtk_widget_queue_draw (dclick_hist);
+}
+
+static gboolean on_hist_draw (GtkWidget *widget, cairo_t *cr, gpointer data)
+{
+    GtkStyleContext *ctx = gtk_widget_get_style_context (widget);
+    int bins[DCLICK_BINS] = { 0 }, i, peak = 1, width, height;
+    double bw, bh, x;
+    GdkRGBA fg;
+
+    width = gtk_widget_get_allocated_width (widget);
+    height = gtk_widget_get_allocated_height (widget);
+    gtk_style_context_get_color (ctx, gtk_style_context_get_state (ctx), &fg);
+
+    for (i = 0; i < n_gaps; i++) bins[MIN (dclick_gaps[i] / DCLICK_BIN, DCLICK_BINS - 1)]++;
+    for (i = 0; i < DCLICK_BINS; i++) peak = MAX (peak, bins[i]);
+
+    /* a bar per slider step, scaled to the tallest */
+    bw = (double) width / DCLICK_BINS;
+    fg.alpha *= 0.4;
+    gdk_cairo_set_source_rgba (cr, &fg);
+    for (i = 0; i < DCLICK_BINS; i++)
+    {
+        if (!bins[i]) continue;
+        bh = (double) height * bins[i] / peak;
+        cairo_rectangle (cr, i * bw + 1, height - bh, bw - 2, bh);
+    }
+    cairo_fill (cr);
+
+    /* the current delay as a solid line, and the suggested one dashed */
+    fg.alpha /= 0.4;
+    gdk_cairo_set_source_rgba (cr, &fg);
+    cairo_set_line_width (cr, 2);
+    x = (double) width * MIN (vals.dclick, DCLICK_MAX) / DCLICK_MAX;
+    cairo_move_to (cr, x, 0);
+    cairo_line_to (cr, x, height);
+    cairo_stroke (cr);
+
+    if (suggested && suggested != vals.dclick)
+    {
+        double dash = 4;
+
+        x = (double) width * MIN (suggested, DCLICK_MAX) / DCLICK_MAX;
+        cairo_set_dash (cr, &dash, 1, 0);
+        cairo_move_to (cr, x, 0);
+        cairo_line_to (cr, x, height);
+        cairo_stroke (cr);
+    }
+
+    return FALSE;
+}
+
+static void on_dclick_use (GtkButton *btn, gpointer ptr)
+{
+    /* moves the slider, which marks the delay dirty - then commit it as if the slider had been let go of */
+    if (!suggested) return;
+    gtk_range_set_value (GTK_RANGE (mouse_dclick), suggested);
+    commit_now ();
+}
+
+/*----------------------------------------------------------------------------*/
+/* Key repeat analyser                                                        */
+/*----------------------------------------------------------------------------*/
+
+static gboolean repeat_matches (double measured, int set)
+{
+    return fabs (measured - set) <= set * REPEAT_TOLERANCE / 100.0 + 2;
+}
+
+static void update_repeat_stats (void)
+{
+    double mean, jitter;
+    int periods;
+    char *str;
+
+    /* the first repeat gives the delay - a period needs at least one more */
+    periods = repeat_run.repeats - 1;
+    if (!kbd_stats || periods < 1) return;
+
+    mean = repeat_run.sum / periods;
+    jitter = sqrt (MAX (repeat_run.sum_sq / periods - mean * mean, 0));
+
+    if (repeat_matches (repeat_run.first_delay, vals.delay) && repeat_matches (mean, vals.interval))
+        str = g_strdup_printf (_("Measured delay %.0f ms (set to %d ms), interval %.1f ms ± %.1f ms (set to %d ms)"),
+            repeat_run.first_delay, vals.delay, mean, jitter, vals.interval);
+    else
+        str = g_strdup_printf (_("Measured delay %.0f ms (set to %d ms), interval %.1f ms ± %.1f ms (set to %d ms) - does not match the settings"),
+            repeat_run.first_delay, vals.delay, mean, jitter, vals.interval);
+    gtk_label_set_text (GTK_LABEL (kbd_stats), str);
+    g_free (str);
+}
+
+static gboolean on_kbd_key_press (GtkWidget *widget, GdkEventKey *event, gpointer data)
+{
+    gint64 now;
+    double gap;
+
+    /* time events as they arrive - GTK makes the repeats itself on Wayland, and stamps them with the original press time */
+    now = g_get_monotonic_time ();
+
+    /* a different key starts a new run - the same one again before its release is a repeat */
+    if (!repeat_run.keycode || event->hardware_keycode != repeat_run.keycode)
+    {
+        memset (&repeat_run, 0, sizeof (repeat_run));
+        repeat_run.keycode = event->hardware_keycode;
+        repeat_run.press = repeat_run.last = now;
+        return FALSE;
+    }
+
+    gap = (now - repeat_run.last) / 1000.0;
+    repeat_run.last = now;
+    if (!repeat_run.repeats++) repeat_run.first_delay = gap;
+    else
+    {
+        repeat_run.sum += gap;
+        repeat_run.sum_sq += gap * gap;
+    }
+    update_repeat_stats ();
+
+    /* let the entry handle the key as well */
+    return FALSE;
+}
+
+static gboolean on_kbd_key_release (GtkWidget *widget, GdkEventKey *event, gpointer data)
+{
+    /* the last figures stay shown until the next key is held */
+    if (event->hardware_keycode == repeat_run.keycode) repeat_run.keycode = 0;
+    return FALSE;
+}
+
 /*----------------------------------------------------------------------------*/
 /* Initial configuration                                                      */
 /*----------------------------------------------------------------------------*/
 
 static void init_config (void)
 {
+    gint64 span;
+
     /* load the current state */
+    span = trace_begin ();
     km_fn.load_config ();
+    trace_end ("load_config", span);
+    vals.dclick = dclick;
+    vals.delay = delay;
+    vals.interval = interval;
+    vals.speed = speed;
+    vals.left_handed = left_handed;
 
-    /* zero timer handles */
-    dctimer = 0;
-    matimer = 0;
-    kbtimer = 0;
+    /* backup the existing state */
+    old_vals = vals;
+    if (km_fn.snapshot) km_fn.snapshot ();
 
-    mouse_speed = (GtkWidget *) gtk_builder_get_object (builder, "mouse_speed");
-    gtk_range_set_value (GTK_RANGE (mouse_speed), (speed + 1) * 5.0);
-    g_signal_connect (mouse_speed, "button-release-event", G_CALLBACK (on_mouse_speed_changed), NULL);
+    /* from here on, the backend is only called from the apply thread */
+    apply_init (&km_fn, on_applied, NULL);
 
-    mouse_dclick = (GtkWidget *) gtk_builder_get_object (builder, "mouse_dclick");
-    gtk_range_set_value (GTK_RANGE (mouse_dclick), dclick);
-    g_signal_connect (mouse_dclick, "button-release-event", G_CALLBACK (on_mouse_dclick_changed), NULL);
+    /* nothing is dirty - the loaded values need not be applied again */
+    dirty = commit_timer = 0;
+    last_commit = commit_cost = 0;
+    sent_vals = vals;
 
-    mouse_left_handed = (GtkWidget *) gtk_builder_get_object (builder, "left_handed");
-    gtk_switch_set_active (GTK_SWITCH (mouse_left_handed), left_handed);
-    g_signal_connect (mouse_left_handed, "notify::active", G_CALLBACK (on_left_handed_toggle), NULL);
+    /* the tabs share size groups so their rows line up */
+    row_group = gtk_size_group_new (GTK_SIZE_GROUP_VERTICAL);
+    unit_group = gtk_size_group_new (GTK_SIZE_GROUP_HORIZONTAL);
+    label_group = gtk_size_group_new (GTK_SIZE_GROUP_HORIZONTAL);
+}
 
-    kb_delay = (GtkWidget *) gtk_builder_get_object (builder, "kb_delay");
-    gtk_range_set_value (GTK_RANGE (kb_delay), delay);
-    g_signal_connect (kb_delay, "button-release-event", G_CALLBACK (on_kb_range_changed), &delay);
+static void revert_config (void)
+{
+    /* drop anything not yet applied, and wait for any apply already under way */
+    if (commit_timer) g_source_remove (commit_timer);
+    commit_timer = 0;
+    dirty = 0;
+    apply_cancel ();
+    apply_flush ();
+
+    /* the apply thread is idle, so the backend can be called from here */
+    if (km_fn.restore) km_fn.restore ();
+    else
+    {
+        apply_settings (KM_MASK (KM_N_SETTINGS) - 1, &old_vals);
+        apply_flush ();
+    }
 
-    kb_interval = (GtkWidget *) gtk_builder_get_object (builder, "kb_interval");
-    gtk_range_set_value (GTK_RANGE (kb_interval), interval);
-    g_signal_connect (kb_interval, "button-release-event", G_CALLBACK (on_kb_range_changed), &interval);
+    if (vals.dclick != old_vals.dclick) show_dclick_time (old_vals.dclick);
+    vals = old_vals;
+    sent_vals = old_vals;
+}
 
-    kb_layout = (GtkWidget *) gtk_builder_get_object (builder, "keyboard_layout");
-    g_signal_connect (kb_layout, "clicked", G_CALLBACK (on_set_keyboard_ext), NULL);
+#ifdef PLUGIN_NAME
+static void update_widgets (void)
+{
+    /* show the current values on whichever tabs have been built, without applying them again */
+    if (mouse_speed)
+    {
+        g_signal_handlers_block_by_func (mouse_speed, on_mouse_speed_changed, NULL);
+        gtk_range_set_value (GTK_RANGE (mouse_speed), (vals.speed + 1) * 5.0);
+        g_signal_handlers_unblock_by_func (mouse_speed, on_mouse_speed_changed, NULL);
+
+        g_signal_handlers_block_by_func (mouse_dclick, on_mouse_dclick_changed, NULL);
+        gtk_range_set_value (GTK_RANGE (mouse_dclick), vals.dclick);
+        g_signal_handlers_unblock_by_func (mouse_dclick, on_mouse_dclick_changed, NULL);
+        update_dclick_stats ();
+
+        g_signal_handlers_block_by_func (mouse_left_handed, on_left_handed_toggle, NULL);
+        gtk_switch_set_active (GTK_SWITCH (mouse_left_handed), vals.left_handed);
+        g_signal_handlers_unblock_by_func (mouse_left_handed, on_left_handed_toggle, NULL);
+    }
 
-    dclick_btn = (GtkWidget *) gtk_builder_get_object (builder, "dclick");
+    if (kb_delay)
+    {
+        g_signal_handlers_block_by_func (kb_delay, on_kb_range_changed, &vals.delay);
+        gtk_range_set_value (GTK_RANGE (kb_delay), vals.delay);
+        g_signal_handlers_unblock_by_func (kb_delay, on_kb_range_changed, &vals.delay);
+
+        g_signal_handlers_block_by_func (kb_interval, on_kb_range_changed, &vals.interval);
+        gtk_range_set_value (GTK_RANGE (kb_interval), vals.interval);
+        g_signal_handlers_unblock_by_func (kb_interval, on_kb_range_changed, &vals.interval);
+    }
+}
+#endif
+
+static void group_widgets (GtkSizeGroup *group, GtkBuilder *bld, ...)
+{
+    const char *name;
+    va_list args;
+
+    va_start (args, bld);
+    while ((name = va_arg (args, const char *)))
+        gtk_size_group_add_widget (group, (GtkWidget *) gtk_builder_get_object (bld, name));
+    va_end (args);
+}
+
+static void init_mouse_page (GtkBuilder *bld)
+{
+    mouse_speed = (GtkWidget *) gtk_builder_get_object (bld, "mouse_speed");
+    gtk_range_set_value (GTK_RANGE (mouse_speed), (vals.speed + 1) * 5.0);
+    g_signal_connect (mouse_speed, "value-changed", G_CALLBACK (on_mouse_speed_changed), NULL);
+    g_signal_connect (mouse_speed, "button-release-event", G_CALLBACK (on_range_done), NULL);
+    g_signal_connect (mouse_speed, "focus-out-event", G_CALLBACK (on_range_done), NULL);
+
+    mouse_dclick = (GtkWidget *) gtk_builder_get_object (bld, "mouse_dclick");
+    gtk_range_set_value (GTK_RANGE (mouse_dclick), vals.dclick);
+    g_signal_connect (mouse_dclick, "value-changed", G_CALLBACK (on_mouse_dclick_changed), NULL);
+    g_signal_connect (mouse_dclick, "button-release-event", G_CALLBACK (on_range_done), NULL);
+    g_signal_connect (mouse_dclick, "focus-out-event", G_CALLBACK (on_range_done), NULL);
+
+    mouse_left_handed = (GtkWidget *) gtk_builder_get_object (bld, "left_handed");
+    gtk_switch_set_active (GTK_SWITCH (mouse_left_handed), vals.left_handed);
+    g_signal_connect (mouse_left_handed, "notify::active", G_CALLBACK (on_left_handed_toggle), NULL);
+
+    dclick_btn = (GtkWidget *) gtk_builder_get_object (bld, "dclick");
     gesture = gtk_gesture_multi_press_new (dclick_btn);
     g_signal_connect (gesture, "pressed", G_CALLBACK (on_gpress), NULL);
-    dclick_ind = (GtkWidget *) gtk_builder_get_object (builder, "dclick_ind");
+    dclick_ind = (GtkWidget *) gtk_builder_get_object (bld, "dclick_ind");
 
     black = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, 32, 32);
     gdk_pixbuf_fill (black, 0x707070ff);
     white = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, 32, 32);
     gdk_pixbuf_fill (white, 0xffffffff);
     gtk_image_set_from_pixbuf (GTK_IMAGE (dclick_ind), black);
+
+    dclick_hist = (GtkWidget *) gtk_builder_get_object (bld, "dclick_hist");
+    g_signal_connect (dclick_hist, "draw", G_CALLBACK (on_hist_draw), NULL);
+    dclick_stats = (GtkWidget *) gtk_builder_get_object (bld, "dclick_stats");
+    dclick_use = (GtkWidget *) gtk_builder_get_object (bld, "dclick_use");
+    g_signal_connect (dclick_use, "clicked", G_CALLBACK (on_dclick_use), NULL);
+    update_dclick_stats ();
+
+    group_widgets (row_group, bld, "speed_box", "click_box", "left_box", NULL);
+    group_widgets (unit_group, bld, "label11", "label12", "label21", "label22", NULL);
+    group_widgets (label_group, bld, "lbl_speed", "lbl_dclick", NULL);
+}
+
+static void init_kbd_page (GtkBuilder *bld)
+{
+    kb_delay = (GtkWidget *) gtk_builder_get_object (bld, "kb_delay");
+    gtk_range_set_value (GTK_RANGE (kb_delay), vals.delay);
+    g_signal_connect (kb_delay, "value-changed", G_CALLBACK (on_kb_range_changed), &vals.delay);
+    g_signal_connect (kb_delay, "button-release-event", G_CALLBACK (on_range_done), NULL);
+    g_signal_connect (kb_delay, "focus-out-event", G_CALLBACK (on_range_done), NULL);
+
+    kb_interval = (GtkWidget *) gtk_builder_get_object (bld, "kb_interval");
+    gtk_range_set_value (GTK_RANGE (kb_interval), vals.interval);
+    g_signal_connect (kb_interval, "value-changed", G_CALLBACK (on_kb_range_changed), &vals.interval);
+    g_signal_connect (kb_interval, "button-release-event", G_CALLBACK (on_range_done), NULL);
+    g_signal_connect (kb_interval, "focus-out-event", G_CALLBACK (on_range_done), NULL);
+
+    /* time the repeats of keys held down in the test entry */
+    g_signal_connect (gtk_builder_get_object (bld, "kbd_entry"), "key-press-event", G_CALLBACK (on_kbd_key_press), NULL);
+    g_signal_connect (gtk_builder_get_object (bld, "kbd_entry"), "key-release-event", G_CALLBACK (on_kbd_key_release), NULL);
+    kbd_stats = (GtkWidget *) gtk_builder_get_object (bld, "kbd_stats");
+
+    kb_layout = (GtkWidget *) gtk_builder_get_object (bld, "keyboard_layout");
+    g_signal_connect (kb_layout, "clicked", G_CALLBACK (on_set_keyboard_ext), NULL);
+
+    group_widgets (row_group, bld, "delay_box", "interval_box", "layout_box", NULL);
+    group_widgets (unit_group, bld, "label31", "label32", "label41", "label42", NULL);
+    group_widgets (label_group, bld, "lbl_delay", "lbl_interval", NULL);
+}
+
+static GtkBuilder *load_ui (const char *name)
+{
+    GtkBuilder *bld;
+    gint64 span;
+
+    /* set the domain explicitly - in plugin mode, pages may be built after another plugin has changed it */
+    span = trace_begin ();
+    bld = gtk_builder_new ();
+    gtk_builder_set_translation_domain (bld, GETTEXT_PACKAGE);
+    gtk_builder_add_from_resource (bld, name, NULL);
+    trace_end ("gtk_builder_add_from_resource", span);
+
+    return bld;
+}
+
+static GtkWidget *build_tab (int tab)
+{
+    /* each page is only built and connected the first time it is needed */
+    if (!tab_builder[tab])
+    {
+        tab_builder[tab] = load_ui (tab ? UI_PATH "keyboard.ui" : UI_PATH "mouse.ui");
+        if (tab) init_kbd_page (tab_builder[tab]);
+        else init_mouse_page (tab_builder[tab]);
+    }
+
+    return (GtkWidget *) gtk_builder_get_object (tab_builder[tab], tab ? "kbd_page" : "mouse_page");
+}
+
+static void free_ui (void)
+{
+    int i;
+
+    for (i = 0; i < 2; i++)
+    {
+        if (tab_builder[i]) g_object_unref (tab_builder[i]);
+        tab_builder[i] = NULL;
+    }
+    g_clear_object (&row_group);
+    g_clear_object (&unit_group);
+    g_clear_object (&label_group);
+    if (burst_timer) g_source_remove (burst_timer);
+    burst_timer = 0;
+    burst_clicks = 0;
+    g_clear_object (&gesture);
+    g_clear_object (&black);
+    g_clear_object (&white);
+    dclick_hist = dclick_stats = dclick_use = NULL;
+    kbd_stats = NULL;
 }
 
 /*----------------------------------------------------------------------------*/
@@ -238,16 +811,18 @@ static void init_config (void)
 
 void init_plugin (GtkWidget *)
 {
+    trace_init ();
+
     setlocale (LC_ALL, "");
     bindtextdomain (GETTEXT_PACKAGE, PACKAGE_LOCALE_DIR);
     bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
     textdomain (GETTEXT_PACKAGE);
 
-    if (getenv ("WAYLAND_DISPLAY")) km_fn = labwc_ifunctions;
+    /* go through the settings service if there is one, so every client shares its state */
+    if (client_connect (TRUE)) km_fn = client_ifunctions;
+    else if (getenv ("WAYLAND_DISPLAY")) km_fn = labwc_ifunctions;
     else km_fn = openbox_ifunctions;
 
-    builder = gtk_builder_new_from_file (PACKAGE_DATA_DIR "/ui/rasputin.ui");
-
     init_config ();
 }
 
@@ -275,14 +850,7 @@ const char *tab_id (int tab)
 
 GtkWidget *get_tab (int tab)
 {
-    GtkWidget *window, *plugin;
-
-    window = (GtkWidget *) gtk_builder_get_object (builder, "notebook");
-    plugin = (GtkWidget *) gtk_builder_get_object (builder, tab ? "kbd_page" : "mouse_page");
-
-    gtk_container_remove (GTK_CONTAINER (window), plugin);
-
-    return plugin;
+    return build_tab (tab);
 }
 
 gboolean reboot_needed (void)
@@ -290,12 +858,20 @@ gboolean reboot_needed (void)
     return FALSE;
 }
 
+void revert_plugin (void)
+{
+    /* for a host with a cancel - put back the settings and files from when the plugin was loaded, and show them */
+    revert_config ();
+    update_widgets ();
+}
+
 void free_plugin (void)
 {
-    if (dctimer) g_source_remove (dctimer);
-    if (matimer) g_source_remove (matimer);
-    if (kbtimer) g_source_remove (kbtimer);
-    g_object_unref (builder);
+    commit_now ();
+    apply_shutdown ();
+    km_fn.free_config ();
+    free_ui ();
+    trace_close ();
 }
 
 #else
@@ -306,6 +882,7 @@ void free_plugin (void)
 
 static gboolean ok_main (GtkButton *button, gpointer data)
 {
+    commit_now ();
     gtk_main_quit ();
     return FALSE;
 }
@@ -313,33 +890,194 @@ static gboolean ok_main (GtkButton *button, gpointer data)
 static gboolean cancel_main (GtkButton *button, gpointer data)
 {
     /* revert to initial state on cancel */
-    left_handed = old_left_handed;
-    speed = old_speed;
-    dclick = old_dclick;
-    delay = old_delay;
-    interval = old_interval;
-
-    km_fn.set_speed ();
-    km_fn.set_doubleclick ();
-    km_fn.set_keyboard ();
-    km_fn.set_lefthanded ();
+    revert_config ();
     gtk_main_quit ();
     return FALSE;
 }
 
 static gboolean close_prog (GtkWidget *widget, GdkEvent *event, gpointer data)
 {
+    commit_now ();
     gtk_main_quit ();
     return TRUE;
 }
 
+/*----------------------------------------------------------------------------*/
+/* Command line mode                                                          */
+/*----------------------------------------------------------------------------*/
+
+static guint cli_parse (const char *name, const char *str, km_values_t *v)
+{
+    char *end;
+    double dval;
+    long ival;
+
+    /* returns the setting the value belongs to as a mask, or 0 if it is not valid */
+    if (!g_strcmp0 (name, "speed"))
+    {
+        dval = g_ascii_strtod (str, &end);
+        if (*end || end == str || dval < -1.0 || dval > 1.0) return 0;
+        v->speed = dval;
+        return KM_MASK (KM_SPEED);
+    }
+    if (!g_strcmp0 (name, "lefthanded"))
+    {
+        if (!g_strcmp0 (str, "1") || !g_ascii_strcasecmp (str, "yes") || !g_ascii_strcasecmp (str, "true")) v->left_handed = TRUE;
+        else if (!g_strcmp0 (str, "0") || !g_ascii_strcasecmp (str, "no") || !g_ascii_strcasecmp (str, "false")) v->left_handed = FALSE;
+        else return 0;
+        return KM_MASK (KM_LEFTHANDED);
+    }
+
+    ival = strtol (str, &end, 10);
+    if (*end || end == str || ival <= 0 || ival > G_MAXINT) return 0;
+    if (!g_strcmp0 (name, "dclick"))
+    {
+        v->dclick = ival;
+        return KM_MASK (KM_DCLICK);
+    }
+    if (!g_strcmp0 (name, "delay"))
+    {
+        v->delay = ival;
+        return KM_MASK (KM_KEYBOARD);
+    }
+    if (!g_strcmp0 (name, "interval"))
+    {
+        v->interval = ival;
+        return KM_MASK (KM_KEYBOARD);
+    }
+    return 0;
+}
+
+static gboolean cli_format (GString *out, const char *name)
+{
+    char buf[G_ASCII_DTOSTR_BUF_SIZE];
+    gboolean all = !g_strcmp0 (name, "all");
+
+    /* one name=value line per setting, in the form --set and profiles use */
+    if (all || !g_strcmp0 (name, "dclick")) g_string_append_printf (out, "dclick=%d\n", dclick);
+    if (all || !g_strcmp0 (name, "speed")) g_string_append_printf (out, "speed=%s\n", g_ascii_formatd (buf, sizeof (buf), "%g", speed));
+    if (all || !g_strcmp0 (name, "delay")) g_string_append_printf (out, "delay=%d\n", delay);
+    if (all || !g_strcmp0 (name, "interval")) g_string_append_printf (out, "interval=%d\n", interval);
+    if (all || !g_strcmp0 (name, "lefthanded")) g_string_append_printf (out, "lefthanded=%d\n", left_handed ? 1 : 0);
+
+    return all || !g_strcmp0 (name, "dclick") || !g_strcmp0 (name, "speed") || !g_strcmp0 (name, "delay")
+        || !g_strcmp0 (name, "interval") || !g_strcmp0 (name, "lefthanded");
+}
+
+static gboolean cli_value (const char *name, const char *str, km_values_t *v, guint *mask)
+{
+    guint bit = name && str ? cli_parse (name, str, v) : 0;
+
+    if (!bit) fprintf (stderr, "rasputin: invalid setting '%s=%s'\n", name ? name : "", str ? str : "");
+    *mask |= bit;
+    return bit != 0;
+}
+
+static int run_cli (int argc, char *argv[])
+{
+    const char *mode = argv[1];
+    GKeyFile *kf;
+    GString *out;
+    km_values_t v;
+    guint mask = 0;
+    char **kv, **keys, *val;
+    int i, res = 0;
+
+    /* use the settings service if it is already running, but don't start one just for this */
+    if (client_connect (FALSE)) km_fn = client_ifunctions;
+    km_fn.load_config ();
+
+    v.dclick = dclick;
+    v.delay = delay;
+    v.interval = interval;
+    v.speed = speed;
+    v.left_handed = left_handed;
+
+    if (!g_strcmp0 (mode, "--get"))
+    {
+        out = g_string_new (NULL);
+        if (argc < 3) cli_format (out, "all");
+        for (i = 2; i < argc; i++)
+        {
+            if (cli_format (out, argv[i])) continue;
+            fprintf (stderr, "rasputin: unknown setting '%s'\n", argv[i]);
+            res = 1;
+        }
+        fputs (out->str, stdout);
+        g_string_free (out, TRUE);
+    }
+    else if (!g_strcmp0 (mode, "--export"))
+    {
+        /* a profile is a key file with the same lines --get prints */
+        out = g_string_new ("[" PROFILE_GROUP "]\n");
+        cli_format (out, "all");
+        if (argc != 3 || commit_file (argv[2], out->str, out->len, NULL) < 0)
+        {
+            fprintf (stderr, "rasputin: could not write profile '%s'\n", argc > 2 ? argv[2] : "");
+            res = 1;
+        }
+        g_string_free (out, TRUE);
+    }
+    else if (!g_strcmp0 (mode, "--import"))
+    {
+        /* a profile need not hold every value - those it leaves out are not changed */
+        kf = g_key_file_new ();
+        if (argc != 3 || !g_key_file_load_from_file (kf, argv[2], G_KEY_FILE_NONE, NULL)
+            || !(keys = g_key_file_get_keys (kf, PROFILE_GROUP, NULL, NULL)))
+        {
+            fprintf (stderr, "rasputin: could not read profile '%s'\n", argc > 2 ? argv[2] : "");
+            res = 1;
+        }
+        else
+        {
+            for (i = 0; keys[i]; i++)
+            {
+                val = g_key_file_get_value (kf, PROFILE_GROUP, keys[i], NULL);
+                if (!cli_value (keys[i], val, &v, &mask)) res = 1;
+                g_free (val);
+            }
+            g_strfreev (keys);
+        }
+        g_key_file_free (kf);
+    }
+    else
+    {
+        for (i = 2; i < argc; i++)
+        {
+            kv = g_strsplit (argv[i], "=", 2);
+            if (!cli_value (kv[0], kv[0] ? kv[1] : NULL, &v, &mask)) res = 1;
+            g_strfreev (kv);
+        }
+    }
+
+    /* nothing is changed unless every value was valid - then they are all applied at once,
+     * with one write of each file and at most one compositor reload */
+    if (!res && mask)
+    {
+        dclick = v.dclick;
+        delay = v.delay;
+        interval = v.interval;
+        speed = v.speed;
+        left_handed = v.left_handed;
+        km_fn.set_many (mask);
+    }
+
+    km_fn.free_config ();
+    return res;
+}
+
 /*----------------------------------------------------------------------------*/
 /* Main function */
 /*----------------------------------------------------------------------------*/
 
 int main (int argc, char* argv[])
 {
-    GtkWidget *main_dlg, *wid;
+    GtkBuilder *builder;
+    GtkWidget *main_dlg, *wid, *nb;
+    gint64 span;
+    int ret;
+
+    trace_init ();
 
     setlocale (LC_ALL, "");
     bindtextdomain (GETTEXT_PACKAGE, PACKAGE_LOCALE_DIR);
@@ -349,9 +1087,23 @@ int main (int argc, char* argv[])
     if (getenv ("WAYLAND_DISPLAY")) km_fn = labwc_ifunctions;
     else km_fn = openbox_ifunctions;
 
+    /* headless batch modes - get, set, export or import any number of values without starting GTK */
+    if (argc > 1 && (!g_strcmp0 (argv[1], "--get") || !g_strcmp0 (argv[1], "--set")
+        || !g_strcmp0 (argv[1], "--export") || !g_strcmp0 (argv[1], "--import")))
+    {
+        span = trace_begin ();
+        ret = run_cli (argc, argv);
+        trace_end (argv[1], span);
+        trace_close ();
+        return ret;
+    }
+
     gtk_init (&argc, &argv);
 
-    builder = gtk_builder_new_from_file (PACKAGE_DATA_DIR "/ui/rasputin.ui");
+    /* go through the settings service if there is one, so every client shares its state */
+    if (client_connect (TRUE)) km_fn = client_ifunctions;
+
+    builder = load_ui (UI_PATH "rasputin.ui");
 
     main_dlg = (GtkWidget *) gtk_builder_get_object (builder, "dlg");
     g_signal_connect (main_dlg, "delete_event", G_CALLBACK (close_prog), NULL);
@@ -363,12 +1115,9 @@ int main (int argc, char* argv[])
 
     init_config ();
 
-    /* backup the existing state */
-    old_left_handed = left_handed;
-    old_speed = speed;
-    old_dclick = dclick;
-    old_delay = delay;
-    old_interval = interval;
+    nb = (GtkWidget *) gtk_builder_get_object (builder, "notebook");
+    gtk_notebook_append_page (GTK_NOTEBOOK (nb), build_tab (0), (GtkWidget *) gtk_builder_get_object (builder, "mouse_lbl"));
+    gtk_notebook_append_page (GTK_NOTEBOOK (nb), build_tab (1), (GtkWidget *) gtk_builder_get_object (builder, "kbd_lbl"));
 
     g_object_unref (builder);
 
@@ -376,6 +1125,12 @@ int main (int argc, char* argv[])
 
     gtk_main ();
 
+    /* wait for any queued changes to be written */
+    apply_shutdown ();
+    km_fn.free_config ();
+    free_ui ();
+    trace_close ();
+
     return 0;
 }
 
@@ -39,12 +39,83 @@ extern const char *dgetfixt (const char *domain, const char *msgctxid);
 
 typedef struct {
     void (*load_config) (void);
+    gboolean (*config_current) (void);
+    void (*free_config) (void);
+    void (*apply_config) (void);
     void (*set_doubleclick) (void);
     void (*set_speed) (void);
     void (*set_keyboard) (void);
     void (*set_lefthanded) (void);
+    void (*set_many) (guint settings);
+    void (*snapshot) (void);
+    void (*restore) (void);
 } km_functions_t;
 
+typedef enum {
+    KM_DCLICK,
+    KM_SPEED,
+    KM_KEYBOARD,
+    KM_LEFTHANDED,
+    KM_N_SETTINGS
+} km_setting_t;
+
+/* Bit for a km_setting_t in a set_many mask */
+#define KM_MASK(setting) (1 << (setting))
+
+typedef struct {
+    int dclick, delay, interval;
+    float speed;
+    gboolean left_handed;
+} km_values_t;
+
+/* Session bus names of the settings service, and the keys of the values it holds */
+#define KM_BUS_NAME "com.raspberrypi.rasputin"
+#define KM_BUS_PATH "/com/raspberrypi/rasputin"
+#define KM_BUS_IFACE "com.raspberrypi.rasputin.Input"
+
+#define KM_KEY_DCLICK "DoubleClick"
+#define KM_KEY_SPEED "PointerSpeed"
+#define KM_KEY_DELAY "RepeatDelay"
+#define KM_KEY_INTERVAL "RepeatInterval"
+#define KM_KEY_LEFT "LeftHanded"
+
+/* Backend names passed to the service - each client picks one from its own session, not the service's */
+#define KM_BACKEND_LABWC "labwc"
+#define KM_BACKEND_OPENBOX "openbox"
+#define KM_SESSION_BACKEND (g_getenv ("WAYLAND_DISPLAY") ? KM_BACKEND_LABWC : KM_BACKEND_OPENBOX)
+
+typedef void (*apply_done_cb) (guint settings, gint64 usecs, gpointer data);
+
+typedef enum {
+    TRACE_BYTES_WRITTEN,
+    TRACE_PROCESSES,
+    TRACE_WRITES_SKIPPED,
+    TRACE_N_COUNTERS
+} trace_counter_t;
+
+#define COMMIT_DIGEST_LEN 32
+
+/* Digest of what a config file was last known to hold */
+typedef struct {
+    gboolean valid;
+    guint8 digest[COMMIT_DIGEST_LEN];
+} commit_hash_t;
+
+/* What stat said about a cached config file when it was last read or written */
+typedef struct {
+    gboolean exists;
+    guint64 dev, ino, size;
+    gint64 mtime, mtime_nsec;
+} file_stamp_t;
+
+/* Bytes of a config file when a snapshot was taken - or that it did not exist */
+typedef struct {
+    char *path;
+    char *data;
+    gsize len;
+    gboolean exists;
+} file_snapshot_t;
+
 /*----------------------------------------------------------------------------*/
 /* Global data */
 /*----------------------------------------------------------------------------*/
@@ -53,6 +124,36 @@ extern int dclick, delay, interval;
 extern float speed;
 extern gboolean left_handed;
 
+/*----------------------------------------------------------------------------*/
+/* Function prototypes */
+/*----------------------------------------------------------------------------*/
+
+/* Background apply queue - apply.c */
+extern void apply_init (km_functions_t *fn, apply_done_cb cb, gpointer data);
+extern void apply_settings (guint settings, const km_values_t *vals);
+extern void apply_flush (void);
+extern void apply_cancel (void);
+extern void apply_shutdown (void);
+
+/* Latency tracing, enabled by RASPUTIN_TRACE=path - trace.c */
+extern void trace_init (void);
+extern void trace_close (void);
+extern gint64 trace_begin (void);
+extern void trace_end (const char *name, gint64 start);
+extern void trace_count (trace_counter_t counter, gint64 delta);
+extern gint64 trace_total (trace_counter_t counter);
+
+/* Settings service client - client.c */
+extern gboolean client_connect (gboolean start);
+
+/* Config file writes - unchanged contents are skipped, anything else is replaced atomically - commit.c */
+extern int commit_file (const char *path, const char *data, gsize len, commit_hash_t *hash);
+extern void snapshot_file (file_snapshot_t *snap, const char *path);
+extern int restore_file (const file_snapshot_t *snap);
+extern void free_snapshot (file_snapshot_t *snap);
+extern gboolean stamp_file (const char *path, file_stamp_t *stamp);
+extern gboolean stamp_current (const char *path, const file_stamp_t *stamp);
+
 /* End of file */
 /*============================================================================*/
 
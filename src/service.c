@@ -0,0 +1,477 @@
+/*============================================================================
+Copyright (c) 2024 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+#include <locale.h>
+#include <signal.h>
+#include <gio/gio.h>
+#include <glib-unix.h>
+
+#include "rasputin.h"
+
+extern km_functions_t labwc_ifunctions;
+extern km_functions_t openbox_ifunctions;
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros */
+/*----------------------------------------------------------------------------*/
+
+/* How each value is named and typed on the bus, and which setting it belongs to */
+typedef struct {
+    const char *name;
+    const char *type;
+    km_setting_t setting;
+    gsize offset;
+} km_key_t;
+
+#define KM_FIELD(field) G_STRUCT_OFFSET (km_values_t, field)
+#define KM_INT(vals,key) G_STRUCT_MEMBER (int, vals, (key)->offset)
+
+/*----------------------------------------------------------------------------*/
+/* Global data */
+/*----------------------------------------------------------------------------*/
+
+/* Setting values - read and written by the backend */
+int dclick, delay, interval;
+float speed;
+gboolean left_handed;
+
+static const km_key_t keys[] = {
+    { KM_KEY_DCLICK,    "i", KM_DCLICK,     KM_FIELD (dclick) },
+    { KM_KEY_SPEED,     "d", KM_SPEED,      KM_FIELD (speed) },
+    { KM_KEY_DELAY,     "i", KM_KEYBOARD,   KM_FIELD (delay) },
+    { KM_KEY_INTERVAL,  "i", KM_KEYBOARD,   KM_FIELD (interval) },
+    { KM_KEY_LEFT,      "b", KM_LEFTHANDED, KM_FIELD (left_handed) },
+    { NULL,             NULL, 0,            0 }
+};
+
+static const char introspection_xml[] =
+    "<node>"
+    "  <interface name='" KM_BUS_IFACE "'>"
+    "    <method name='Get'>"
+    "      <arg type='s' name='name' direction='in'/>"
+    "      <arg type='v' name='value' direction='out'/>"
+    "    </method>"
+    "    <method name='GetAll'>"
+    "      <arg type='a{sv}' name='values' direction='out'/>"
+    "    </method>"
+    "    <method name='Set'>"
+    "      <arg type='s' name='name' direction='in'/>"
+    "      <arg type='v' name='value' direction='in'/>"
+    "    </method>"
+    "    <method name='SetMany'>"
+    "      <arg type='a{sv}' name='values' direction='in'/>"
+    "    </method>"
+    "    <method name='Snapshot'/>"
+    "    <method name='Restore'/>"
+    "    <method name='SetBackend'>"
+    "      <arg type='s' name='name' direction='in'/>"
+    "    </method>"
+    "    <signal name='Changed'>"
+    "      <arg type='a{sv}' name='values'/>"
+    "    </signal>"
+    "  </interface>"
+    "</node>";
+
+static km_functions_t km_fn;
+static const char *backend;
+
+/* Values the backend last loaded or applied, and whether there are any */
+static km_values_t cur;
+static gboolean loaded;
+
+/* Client whose Snapshot the backend holds, and the watch which releases it if that client goes away */
+static char *snapshot_owner;
+static guint snapshot_watch;
+
+static GMainLoop *loop;
+static GDBusNodeInfo *introspection;
+
+/*----------------------------------------------------------------------------*/
+/* Function prototypes */
+/*----------------------------------------------------------------------------*/
+
+static gboolean select_backend (const char *name);
+static void refresh_values (void);
+static const km_key_t *find_key (const char *name);
+static GVariant *get_value (const km_key_t *key, const km_values_t *vals);
+static gboolean put_value (const km_key_t *key, GVariant *value, km_values_t *vals);
+static gboolean same_value (const km_key_t *key, const km_values_t *a, const km_values_t *b);
+static guint diff_values (const km_values_t *from, const km_values_t *to, GVariantBuilder *changes);
+static void apply_values (const km_values_t *vals, guint changed);
+static void set_values (GDBusConnection *conn, GVariantIter *iter, GDBusMethodInvocation *invocation);
+static void release_snapshot (void);
+static void owner_vanished (GDBusConnection *conn, const char *name, gpointer data);
+static void method_call (GDBusConnection *conn, const char *sender, const char *path, const char *iface,
+    const char *method, GVariant *params, GDBusMethodInvocation *invocation, gpointer data);
+static void bus_acquired (GDBusConnection *conn, const char *name, gpointer data);
+static void name_lost (GDBusConnection *conn, const char *name, gpointer data);
+static gboolean quit_service (gpointer data);
+
+/*----------------------------------------------------------------------------*/
+/* Helper functions */
+/*----------------------------------------------------------------------------*/
+
+static gboolean select_backend (const char *name)
+{
+    if (!g_strcmp0 (name, backend)) return TRUE;
+    if (g_strcmp0 (name, KM_BACKEND_LABWC) && g_strcmp0 (name, KM_BACKEND_OPENBOX)) return FALSE;
+
+    // the service was started for another session type - drop that backend, and anything it was holding
+    if (backend) km_fn.free_config ();
+    release_snapshot ();
+    loaded = FALSE;
+    if (!g_strcmp0 (name, KM_BACKEND_LABWC))
+    {
+        km_fn = labwc_ifunctions;
+        backend = KM_BACKEND_LABWC;
+    }
+    else
+    {
+        km_fn = openbox_ifunctions;
+        backend = KM_BACKEND_OPENBOX;
+    }
+    return TRUE;
+}
+
+static void refresh_values (void)
+{
+    gint64 span;
+
+    // other tools can change the files or gsettings at any time - the backend knows whether they have
+    if (loaded && km_fn.config_current && km_fn.config_current ()) return;
+
+    span = trace_begin ();
+    km_fn.load_config ();
+    trace_end ("service load_config", span);
+    loaded = TRUE;
+
+    cur.dclick = dclick;
+    cur.delay = delay;
+    cur.interval = interval;
+    cur.speed = speed;
+    cur.left_handed = left_handed;
+}
+
+static const km_key_t *find_key (const char *name)
+{
+    const km_key_t *key;
+
+    for (key = keys; key->name; key++)
+        if (!g_strcmp0 (key->name, name)) return key;
+    return NULL;
+}
+
+static GVariant *get_value (const km_key_t *key, const km_values_t *vals)
+{
+    if (key->setting == KM_SPEED) return g_variant_new_double (vals->speed);
+    if (key->setting == KM_LEFTHANDED) return g_variant_new_boolean (vals->left_handed);
+    return g_variant_new_int32 (KM_INT (vals, key));
+}
+
+static gboolean put_value (const km_key_t *key, GVariant *value, km_values_t *vals)
+{
+    double dval;
+
+    // reject anything the backends could not store - the speed range matches the libinput one
+    if (!g_variant_is_of_type (value, G_VARIANT_TYPE (key->type))) return FALSE;
+    if (key->setting == KM_SPEED)
+    {
+        dval = g_variant_get_double (value);
+        if (dval < -1.0 || dval > 1.0) return FALSE;
+        vals->speed = dval;
+    }
+    else if (key->setting == KM_LEFTHANDED) vals->left_handed = g_variant_get_boolean (value);
+    else
+    {
+        if (g_variant_get_int32 (value) <= 0) return FALSE;
+        KM_INT (vals, key) = g_variant_get_int32 (value);
+    }
+    return TRUE;
+}
+
+static gboolean same_value (const km_key_t *key, const km_values_t *a, const km_values_t *b)
+{
+    if (key->setting == KM_SPEED) return a->speed == b->speed;
+    if (key->setting == KM_LEFTHANDED) return !a->left_handed == !b->left_handed;
+    return KM_INT (a, key) == KM_INT (b, key);
+}
+
+static guint diff_values (const km_values_t *from, const km_values_t *to, GVariantBuilder *changes)
+{
+    const km_key_t *key;
+    guint changed = 0;
+
+    // list each value that differs, for the Changed signal, and return the settings they belong to
+    g_variant_builder_init (changes, G_VARIANT_TYPE ("a{sv}"));
+    for (key = keys; key->name; key++)
+    {
+        if (same_value (key, from, to)) continue;
+        g_variant_builder_add (changes, "{sv}", key->name, get_value (key, to));
+        changed |= KM_MASK (key->setting);
+    }
+    return changed;
+}
+
+static void apply_values (const km_values_t *vals, guint changed)
+{
+    gint64 span;
+
+    // the backends read the setting globals
+    dclick = vals->dclick;
+    delay = vals->delay;
+    interval = vals->interval;
+    speed = vals->speed;
+    left_handed = vals->left_handed;
+
+    // everything changed by one call is written in one commit
+    span = trace_begin ();
+    km_fn.set_many (changed);
+    trace_end ("service apply", span);
+
+    cur = *vals;
+}
+
+static void set_values (GDBusConnection *conn, GVariantIter *iter, GDBusMethodInvocation *invocation)
+{
+    const km_key_t *key;
+    GVariantBuilder changes;
+    km_values_t vals = cur;
+    guint changed;
+    const char *name;
+    GVariant *value;
+
+    // check everything before applying anything, so a bad call changes nothing
+    while (g_variant_iter_next (iter, "{&sv}", &name, &value))
+    {
+        key = find_key (name);
+        if (!key || !put_value (key, value, &vals))
+        {
+            g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                "Invalid value for '%s'", name);
+            g_variant_unref (value);
+            return;
+        }
+        g_variant_unref (value);
+    }
+
+    // only values that differ from those applied reach the backend or the Changed signal
+    changed = diff_values (&cur, &vals, &changes);
+
+    if (changed) apply_values (&vals, changed);
+    g_dbus_method_invocation_return_value (invocation, NULL);
+
+    if (changed) g_dbus_connection_emit_signal (conn, NULL, KM_BUS_PATH, KM_BUS_IFACE, "Changed",
+        g_variant_new ("(a{sv})", &changes), NULL);
+    else g_variant_builder_clear (&changes);
+}
+
+static void release_snapshot (void)
+{
+    if (snapshot_watch) g_bus_unwatch_name (snapshot_watch);
+    snapshot_watch = 0;
+    g_clear_pointer (&snapshot_owner, g_free);
+}
+
+static void owner_vanished (GDBusConnection *conn, const char *name, gpointer data)
+{
+    // the client exited without restoring - its changes stand, and another client may take a snapshot
+    release_snapshot ();
+}
+
+static void method_call (GDBusConnection *conn, const char *sender, const char *path, const char *iface,
+    const char *method, GVariant *params, GDBusMethodInvocation *invocation, gpointer data)
+{
+    const km_key_t *key;
+    GVariantBuilder all;
+    GVariantIter *iter;
+    const char *name;
+    GVariant *value, *single;
+    GVariantBuilder changes;
+    km_values_t before;
+
+    if (!g_strcmp0 (method, "SetBackend"))
+    {
+        // switching would drop the backend's snapshot
+        g_variant_get (params, "(&s)", &name);
+        if (snapshot_owner && g_strcmp0 (sender, snapshot_owner) && g_strcmp0 (name, backend))
+        {
+            g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_ACCESS_DENIED,
+                "Settings are held by another client");
+            return;
+        }
+        if (select_backend (name)) g_dbus_method_invocation_return_value (invocation, NULL);
+        else g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+            "No such backend '%s'", name);
+        return;
+    }
+
+    // values are compared against what is stored now, not what was stored when the service started
+    refresh_values ();
+
+    if (!g_strcmp0 (method, "Snapshot") || !g_strcmp0 (method, "Restore"))
+    {
+        // the backend holds one snapshot, so only the client which took it can replace it or restore it - until it exits
+        if (snapshot_owner && g_strcmp0 (sender, snapshot_owner))
+        {
+            g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_ACCESS_DENIED,
+                "Settings are held by another client");
+            return;
+        }
+        if (!snapshot_owner && !g_strcmp0 (method, "Restore"))
+        {
+            g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                "No snapshot to restore");
+            return;
+        }
+    }
+
+    if (!g_strcmp0 (method, "Snapshot"))
+    {
+        // the backend keeps the exact bytes of its files, so a restore undoes more than the values
+        if (km_fn.snapshot) km_fn.snapshot ();
+        if (!snapshot_owner)
+        {
+            snapshot_owner = g_strdup (sender);
+            snapshot_watch = g_bus_watch_name_on_connection (conn, sender, G_BUS_NAME_WATCHER_FLAGS_NONE,
+                NULL, owner_vanished, NULL, NULL);
+        }
+        g_dbus_method_invocation_return_value (invocation, NULL);
+    }
+    else if (!g_strcmp0 (method, "Restore"))
+    {
+        before = cur;
+        if (km_fn.restore) km_fn.restore ();
+        loaded = FALSE;
+        refresh_values ();
+        g_dbus_method_invocation_return_value (invocation, NULL);
+
+        if (diff_values (&before, &cur, &changes)) g_dbus_connection_emit_signal (conn, NULL, KM_BUS_PATH, KM_BUS_IFACE,
+            "Changed", g_variant_new ("(a{sv})", &changes), NULL);
+        else g_variant_builder_clear (&changes);
+    }
+    else if (!g_strcmp0 (method, "Get"))
+    {
+        g_variant_get (params, "(&s)", &name);
+        key = find_key (name);
+        if (key) g_dbus_method_invocation_return_value (invocation, g_variant_new ("(v)", get_value (key, &cur)));
+        else g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+            "No such setting '%s'", name);
+    }
+    else if (!g_strcmp0 (method, "GetAll"))
+    {
+        g_variant_builder_init (&all, G_VARIANT_TYPE ("a{sv}"));
+        for (key = keys; key->name; key++)
+            g_variant_builder_add (&all, "{sv}", key->name, get_value (key, &cur));
+        g_dbus_method_invocation_return_value (invocation, g_variant_new ("(a{sv})", &all));
+    }
+    else if (!g_strcmp0 (method, "Set"))
+    {
+        // a single value goes through the same path as many
+        g_variant_get (params, "(&sv)", &name, &value);
+        g_variant_builder_init (&all, G_VARIANT_TYPE ("a{sv}"));
+        g_variant_builder_add (&all, "{sv}", name, value);
+        g_variant_unref (value);
+        single = g_variant_ref_sink (g_variant_builder_end (&all));
+        iter = g_variant_iter_new (single);
+        set_values (conn, iter, invocation);
+        g_variant_iter_free (iter);
+        g_variant_unref (single);
+    }
+    else if (!g_strcmp0 (method, "SetMany"))
+    {
+        g_variant_get (params, "(a{sv})", &iter);
+        set_values (conn, iter, invocation);
+        g_variant_iter_free (iter);
+    }
+}
+
+static void bus_acquired (GDBusConnection *conn, const char *name, gpointer data)
+{
+    static const GDBusInterfaceVTable vtable = { method_call, NULL, NULL };
+
+    g_dbus_connection_register_object (conn, KM_BUS_PATH, introspection->interfaces[0], &vtable, NULL, NULL, NULL);
+}
+
+static void name_lost (GDBusConnection *conn, const char *name, gpointer data)
+{
+    // another instance owns the name, or the bus has gone
+    g_main_loop_quit (loop);
+}
+
+static gboolean quit_service (gpointer data)
+{
+    g_main_loop_quit (loop);
+    return FALSE;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Main function */
+/*----------------------------------------------------------------------------*/
+
+int main (int argc, char *argv[])
+{
+    guint owner;
+
+    trace_init ();
+
+    setlocale (LC_ALL, "");
+
+    // until a client says otherwise, assume the session the service was started in
+    select_backend (KM_SESSION_BACKEND);
+
+    // headless mode for session start - apply the stored settings and exit without taking the bus name
+    if (argc > 1 && !g_strcmp0 (argv[1], "--apply"))
+    {
+        if (km_fn.apply_config) km_fn.apply_config ();
+        km_fn.free_config ();
+        trace_close ();
+        return 0;
+    }
+
+    introspection = g_dbus_node_info_new_for_xml (introspection_xml, NULL);
+    owner = g_bus_own_name (G_BUS_TYPE_SESSION, KM_BUS_NAME, G_BUS_NAME_OWNER_FLAGS_NONE,
+        bus_acquired, NULL, name_lost, NULL, NULL);
+
+    loop = g_main_loop_new (NULL, FALSE);
+    g_unix_signal_add (SIGINT, quit_service, NULL);
+    g_unix_signal_add (SIGTERM, quit_service, NULL);
+    g_main_loop_run (loop);
+
+    release_snapshot ();
+    g_bus_unown_name (owner);
+    g_main_loop_unref (loop);
+    g_dbus_node_info_unref (introspection);
+
+    // send anything still waiting, such as a compositor reload
+    km_fn.free_config ();
+    trace_close ();
+
+    return 0;
+}
+
+/* End of file */
+/*============================================================================*/
@@ -0,0 +1,143 @@
+/*============================================================================
+Copyright (c) 2024 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <gio/gio.h>
+
+#include "rasputin.h"
+
+/*----------------------------------------------------------------------------*/
+/* Global data */
+/*----------------------------------------------------------------------------*/
+
+static FILE *trace_fp;
+static GMutex trace_lock;
+static gboolean trace_first;
+
+/* Running totals - kept whether or not a trace is being written */
+static gint64 totals[TRACE_N_COUNTERS];
+
+static const char *counter_names[TRACE_N_COUNTERS] = {
+    "bytes written",
+    "processes spawned",
+    "writes skipped"
+};
+
+/*----------------------------------------------------------------------------*/
+/* Function prototypes */
+/*----------------------------------------------------------------------------*/
+
+static void write_event (const char *fmt, ...);
+
+/*----------------------------------------------------------------------------*/
+/* Helper functions */
+/*----------------------------------------------------------------------------*/
+
+static void write_event (const char *fmt, ...)
+{
+    va_list args;
+
+    // caller must hold trace_lock
+    if (!trace_first) fputs (",\n", trace_fp);
+    trace_first = FALSE;
+
+    va_start (args, fmt);
+    vfprintf (trace_fp, fmt, args);
+    va_end (args);
+    fflush (trace_fp);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Exported API */
+/*----------------------------------------------------------------------------*/
+
+void trace_init (void)
+{
+    const char *path = g_getenv ("RASPUTIN_TRACE");
+
+    if (!path || trace_fp) return;
+
+    // Chrome trace-event format - a JSON array of events, loadable in about:tracing or Perfetto
+    trace_fp = fopen (path, "w");
+    if (!trace_fp) return;
+    fputs ("[\n", trace_fp);
+    trace_first = TRUE;
+}
+
+void trace_close (void)
+{
+    g_mutex_lock (&trace_lock);
+    if (trace_fp)
+    {
+        fputs ("\n]\n", trace_fp);
+        fclose (trace_fp);
+        trace_fp = NULL;
+    }
+    g_mutex_unlock (&trace_lock);
+}
+
+gint64 trace_begin (void)
+{
+    return trace_fp ? g_get_monotonic_time () : 0;
+}
+
+void trace_end (const char *name, gint64 start)
+{
+    gint64 now;
+
+    if (!start) return;
+    now = g_get_monotonic_time ();
+
+    g_mutex_lock (&trace_lock);
+    if (trace_fp) write_event ("{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%" G_GINT64_FORMAT ",\"dur\":%" G_GINT64_FORMAT ",\"pid\":%d,\"tid\":%ld}",
+        name, start, now - start, getpid (), (long) syscall (SYS_gettid));
+    g_mutex_unlock (&trace_lock);
+}
+
+void trace_count (trace_counter_t counter, gint64 delta)
+{
+    g_mutex_lock (&trace_lock);
+    totals[counter] += delta;
+    if (trace_fp) write_event ("{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%" G_GINT64_FORMAT ",\"pid\":%d,\"args\":{\"value\":%" G_GINT64_FORMAT "}}",
+        counter_names[counter], g_get_monotonic_time (), getpid (), totals[counter]);
+    g_mutex_unlock (&trace_lock);
+}
+
+gint64 trace_total (trace_counter_t counter)
+{
+    gint64 val;
+
+    g_mutex_lock (&trace_lock);
+    val = totals[counter];
+    g_mutex_unlock (&trace_lock);
+    return val;
+}
+
+/* End of file */
+/*============================================================================*/